@@ -9,18 +9,55 @@
  */
 #include "config.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <poll.h>
+#include <spawn.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifdef HAVE_LIBGVC
+#include <gvc.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
 
+#include <algorithm>
 #include <cassert>
+#include <condition_variable>
+#include <deque>
 #include <map>
-#include <queue>
+#include <mutex>
+#include <set>
 #include <stack>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
@@ -38,6 +75,29 @@ typedef struct dot_color_map_s
 	node_color_t colors;
 } dot_color_map_t;
 
+/* what we write to stdout instead of files */
+typedef enum stdout_mode_e
+{
+	StdoutNone = 0,
+	StdoutPicture,
+	StdoutDot				/* the dot script, nothing is rendered */
+} stdout_mode_t;
+
+/* Options without a short form. */
+typedef enum long_option_e
+{
+	OptMaxDepth = 256,
+	OptMaxChildren,
+	OptInclude,
+	OptExclude,
+	OptPageSize,
+	OptCacheDir,
+	OptCacheSize,
+	OptNormalize,
+	OptServe,
+	OptWatch
+} long_option_t;
+
 typedef enum tag_e
 {
 	TagHide = 0,
@@ -46,17 +106,421 @@ typedef enum tag_e
 	TagItem
 } tag_t;
 
-typedef struct node_s node_t;
+/*
+ * A span of bytes within the input buffer.  Node names are kept as spans
+ * into the input, so they are never copied while parsing.
+ */
+typedef struct span_s
+{
+	const char *ptr;
+	size_t      len;
+} span_t;
 
-struct node_s
+/*
+ * The whole content of an input file.  Regular files are mapped into
+ * memory, anything else (pipes, character devices) is read in large
+ * blocks into a heap buffer.
+ */
+typedef struct input_s
 {
-	tag_t            tag;
-	string           name;
-	size_t           index;		/* index in elems */
-	size_t           suffix;	/* dot node suffix */
-	vector<string>   edges;
-	vector<node_t *> elems;
-};
+	const char *data;
+	size_t      size;
+	bool        mapped;
+} input_t;
+
+/*
+ * Compressed inputs are recognized by their magic bytes and decompressed
+ * on the fly.  A child process decompresses the input into a pipe while we
+ * parse what it has already produced.
+ */
+typedef enum compression_e
+{
+	CompressNone = 0,
+	CompressGzip,
+	CompressZstd,
+	CompressLz4
+} compression_t;
+
+#define DECOMPRESS_CHUNK_SIZE		(1024 * 1024)
+
+/*
+ * A process rather than a thread, so we can go on forking render jobs
+ * while it runs.  The child writes a byte to another pipe when it has
+ * decompressed everything; its exit status is no good for that, the job
+ * pools may reap it.
+ */
+typedef struct decompressor_s
+{
+	int           fd;				/* the compressed input */
+	string        head;				/* read from fd before we started */
+	const char   *filename;
+	compression_t compression;
+	pid_t         pid;
+	int           data_fd;			/* the decompressed data */
+	int           status_fd;		/* the byte of a successful child */
+	bool          done;				/* the data has been read to the end */
+	bool          failed;			/* the child reported an error */
+} decompressor_t;
+
+/*
+ * Structural character scanner.
+ *
+ * The parser only cares about '{', '}', '(', ')' and ':', everything else
+ * is a part of names or whitespace.  The scanner classifies the input 64
+ * bytes at a time into a bitmap of structural characters, so the parser
+ * can jump from one structural character to the next.
+ */
+#define SCAN_BLOCK_SIZE		64
+
+typedef uint64_t (*structural_mask_fn)(const char *block);
+
+typedef struct scanner_s
+{
+	const char *block;		/* start of the current block */
+	const char *end;		/* end of the input */
+	uint64_t    mask;		/* structural characters left in the block */
+} scanner_t;
+
+/*
+ * Buffered output writer.  The dot script is formatted in place into a large
+ * reusable buffer, which is written out with write(2) when it is full.
+ *
+ * A writer without file descriptor keeps everything in memory, the buffer
+ * grows as needed.
+ */
+#define WRITER_BUFFER_SIZE		(1024 * 1024)
+
+typedef struct writer_s
+{
+	int     fd;
+	char   *buf;
+	size_t  len;
+	size_t  size;
+	bool    failed;		/* a write(2) failed, errno is kept in error */
+	int     error;
+} writer_t;
+
+#define put_literal(w, s)	put_bytes((w), (s), sizeof(s) - 1)
+
+/*
+ * Streaming XXH64, the key of the render cache.  The input is consumed in
+ * stripes of 32 bytes, the rest waits in buf for the next update.
+ */
+#define HASHER_STRIPE_SIZE		32
+
+typedef struct hasher_s
+{
+	uint64_t      acc[4];
+	unsigned char buf[HASHER_STRIPE_SIZE];
+	size_t        buflen;
+	uint64_t      total;
+} hasher_t;
+
+/* a picture in the render cache, see evict_cache() */
+typedef struct cache_entry_s
+{
+	string  name;
+	time_t  mtime;
+	off_t   size;
+} cache_entry_t;
+
+/*
+ * Reads a file line by line, through a buffer which only grows for very
+ * long lines.
+ */
+#define LINE_READER_BUFFER_SIZE		(1024 * 1024)
+
+typedef struct line_reader_s
+{
+	int             fd;
+	decompressor_t *dc;			/* set if the file is compressed */
+	char           *buf;
+	size_t          size;
+	size_t          start;		/* start of the unread data */
+	size_t          end;		/* end of the data in buf */
+	bool            eof;
+	bool            follow;		/* more data may be appended to the file */
+	bool            failed;		/* a read(2) failed, errno is kept in error */
+	int             error;
+} line_reader_t;
+
+/* how long to wait for the log to grow before looking again, in ms */
+#define FOLLOW_POLL_INTERVAL	1000
+
+/*
+ * A node tree extracted from a server log, and the name of its picture
+ * without suffix.
+ */
+typedef struct log_tree_s
+{
+	string text;
+	string pathname;
+} log_tree_t;
+
+typedef struct log_extractor_s
+{
+	const char *filename;	/* the server log */
+	size_t      ntrees;		/* complete node trees so far */
+	bool        in_tree;	/* collecting the lines of a node tree */
+	long        depth;		/* depth of braces in the node tree */
+	string      title;		/* message of the last LOG line */
+	log_tree_t  tree;
+} log_extractor_t;
+
+typedef enum log_feed_e
+{
+	LogFeedNext = 0,		/* feed the next line */
+	LogFeedTree,			/* a node tree is complete, feed the next line */
+	LogFeedTreeAgain		/* a node tree is complete, feed the line again */
+} log_feed_t;
+
+/*
+ * A chunk of a server log scanned by a thread.  The thread owns the log
+ * entries which start in [start, stop), but reads up to end to finish the
+ * last node tree.
+ */
+#define LOG_CHUNK_SIZE		(64 * 1024 * 1024)
+
+typedef struct log_chunk_s
+{
+	const char        *filename;
+	const char        *begin;		/* start of the log */
+	const char        *end;			/* end of the log */
+	const char        *start;
+	const char        *stop;
+	vector<log_tree_t> trees;		/* node trees found in this chunk */
+} log_chunk_t;
+
+/*
+ * Runs jobs in child processes, at most max_jobs of them at the same time.
+ */
+typedef struct job_pool_s
+{
+	int                max_jobs;
+	size_t             nfailed;
+	bool               quiet;		/* do not report the jobs */
+	map<pid_t, string> running;		/* pid -> label of the job */
+	vector<string>    *succeeded;	/* if set, gets the labels of the jobs
+									 * that succeed */
+} job_pool_t;
+
+/*
+ * The render server of --serve.  The main thread accepts the connections,
+ * and a pool of threads serves them, a request per connection.
+ */
+#define SERVE_TIMEOUT		60		/* seconds to send a request, or to read
+									 * the answer */
+#define SERVE_FORMAT_MAX	32
+#define SERVE_REQUEST_MAX	(256 * 1024 * 1024)
+
+typedef struct render_server_s
+{
+	int                 listen_fd;
+	mutex               lock;		/* protects the fields below */
+	condition_variable  changed;
+	deque<int>          clients;	/* accepted, not served yet */
+	bool                stop;
+} render_server_t;
+
+/*
+ * The state of --watch.  A file is rendered again only if it changed since
+ * we started its job, so a file we cannot render is not retried forever.
+ */
+typedef struct watcher_s
+{
+	const char                 *dirname;
+	job_pool_t                  pool;
+	map<string, struct timespec> started;	/* file -> mtime, until its job
+											 * succeeds or it is gone */
+	vector<string>              succeeded;	/* jobs done since we looked */
+} watcher_t;
+
+#define InvalidNode		((uint32_t) -1)
+#define ExtraName		(UINT64_C(1) << 63)	/* name_off is into extra_names */
+
+/*
+ * A node tree in a flat, struct-of-arrays layout.
+ *
+ * Nodes (both "{NODE" and ":field") are numbered in the order they appear
+ * in the input, so the root is node 0 and the number is also the suffix of
+ * the dot node it creates.  Names are offsets into the input buffer rather
+ * than pointers, so the arrays do not depend on where the input is mapped.
+ * The names of the placeholders for hidden subtrees are not in the input,
+ * they are kept in extra_names.
+ */
+typedef struct node_tree_s
+{
+	const char          *base;		/* input buffer names refer to */
+	vector<uint8_t>      tag;		/* tag_t */
+	vector<uint64_t>     name_off;
+	vector<uint32_t>     name_len;
+	vector<uint32_t>     parent;
+	vector<uint32_t>     first_child;
+	vector<uint32_t>     last_child;
+	vector<uint32_t>     next_sibling;
+	vector<uint32_t>     index;		/* index in parent's elems */
+	vector<uint32_t>     suffix;	/* dot node suffix */
+	vector<uint8_t>      shared;	/* others are merged into it, with -M */
+	string               extra_names;
+} node_tree_t;
+
+/*
+ * A huge graph cut into pages, see split_graph().  Each page is a subtree
+ * of dot nodes, rendered into a picture of its own, with stubs for the
+ * edges to and from the other pages.
+ */
+typedef struct graph_pages_s
+{
+	vector<uint32_t> page;		/* the page of each dot node, by suffix */
+	vector<uint32_t> roots;		/* the first dot node of each page */
+	vector<uint32_t> from;		/* the page each page hangs from */
+	vector<string>   dotfiles;
+	vector<string>   imgfiles;
+} graph_pages_t;
+
+typedef struct page_job_s
+{
+	const node_tree_t   *tree;
+	const graph_pages_t *pages;
+	uint32_t             page;
+} page_job_t;
+
+/*
+ * A type of the nodes hidden by a placeholder, named by a span of
+ * node_parser_t.hidden_names.
+ */
+typedef struct hidden_type_s
+{
+	uint32_t off;
+	uint32_t len;
+	uint32_t count;
+} hidden_type_t;
+
+/*
+ * Push parser of a node tree.  The input is fed in chunks of any size, the
+ * parser keeps its state between them, so we can parse a node tree as it
+ * arrives from a pipe or a socket.
+ */
+typedef enum parse_result_e
+{
+	ParseNeedMore = 0,		/* feed the next chunk */
+	ParseComplete,			/* the root node is closed */
+	ParseError				/* this is not a node tree */
+} parse_result_t;
+
+typedef struct node_parser_s
+{
+	node_tree_t     *tree;
+	const char      *data;			/* the input so far */
+	size_t           size;
+	bool             copied;		/* data is our copy in buf */
+	string           buf;
+	size_t           pos;			/* where we stopped scanning */
+	stack<uint32_t>  nodes_stack;
+	bool             prev_is_item;
+	char             name_token;	/* '{' or ':' of the name being read */
+	size_t           name_start;	/* where the name starts in data */
+	uint32_t         depth;			/* the nodes in nodes_stack */
+
+	/*
+	 * The subtrees beyond --max-depth or --max-children are skipped, and
+	 * replaced by a placeholder with the number of nodes in them by type.
+	 */
+	uint32_t         skip_depth;	/* the open nodes being skipped */
+	bool             skip_count;	/* count them in the placeholder */
+	bool             skip_field;	/* the field just read is filtered */
+	uint32_t         placeholder;	/* not written out yet */
+	uint32_t         nhidden;
+	vector<hidden_type_t> hidden_types;	/* a few, searched in order */
+	string           hidden_names;
+	string           type;
+
+	/* the names of the normalized fields, in tree->extra_names */
+	map<string, uint64_t> normalized_names;
+} node_parser_t;
+
+
+/*
+ * Native layout, see render_graph_native().  The sizes are in pixels, with
+ * a 14px Times font, the default font of Graphviz.
+ */
+#define NATIVE_FONT_SIZE			14
+#define NATIVE_DEFAULT_CHAR_WIDTH	500		/* in 1/1000 em, out of ASCII */
+#define NATIVE_LINE_HEIGHT			17
+#define NATIVE_CELL_PADDING			4
+#define NATIVE_NODE_SEP				18		/* between boxes in a column */
+#define NATIVE_RANK_SEP				48		/* between columns */
+#define NATIVE_MARGIN				8
+
+typedef enum native_align_e
+{
+	AlignCenter,
+	AlignLeft,
+} native_align_t;
+
+/* A line of text in a row, the text is in native_layout_t.text. */
+typedef struct native_line_s
+{
+	size_t          offset;
+	size_t          len;
+	long            width;
+	native_align_t  align;
+	long            span;		/* where it starts if left aligned, otherwise
+								 * the width it is centered in, 0 for all */
+} native_line_t;
+
+/* A row of a box, a cell of the table in write_dot_node_body(). */
+typedef struct native_row_s
+{
+	uint32_t        index;		/* the port of the row, 0 for the header */
+	bool            header;
+	uint32_t        first_line;
+	uint32_t        nlines;
+	long            top;		/* relative to the top of the box */
+	long            text_width;
+	long            width;
+	long            height;
+} native_row_t;
+
+/* The extent of a subtree at each depth, the deepest first. */
+typedef struct contour_s
+{
+	vector<long> top;
+	vector<long> bottom;
+	long         offset;		/* added to top and bottom */
+} contour_t;
+
+/* An edge which is not part of the tree, see merge_subtrees(). */
+typedef struct native_edge_s
+{
+	uint32_t src;
+	uint32_t port;
+	uint32_t dst;
+} native_edge_t;
+
+/* The boxes and the edges between them, indexed by node. */
+typedef struct native_layout_s
+{
+	vector<uint32_t> nodes;			/* the boxes, in creation order */
+	vector<uint32_t> parent;		/* where the incoming edge starts */
+	vector<uint32_t> first_child;
+	vector<uint32_t> last_child;
+	vector<uint32_t> next_sibling;
+	vector<uint32_t> port;			/* the row of parent the edge starts from */
+	vector<uint32_t> depth;
+	vector<long>     width;
+	vector<long>     height;
+	vector<long>     x;
+	vector<long>     y;
+	vector<uint32_t> first_row;		/* the rows of the box */
+	vector<uint32_t> nrows;
+	vector<native_row_t>  rows;
+	vector<native_line_t> lines;
+	string           text;
+	vector<native_edge_t> merged_edges;
+	long             graph_width;
+	long             graph_height;
+} native_layout_t;
 
 
 /* global variables */
@@ -64,14 +528,47 @@ static const char *progname;
 
 static bool enable_color = false;
 static bool enable_skip_empty = false;
+static bool enable_server_log = false;
+static bool enable_follow = false;
+static bool enable_native_layout = false;
+static bool enable_merge_subtrees = false;
+static uint32_t max_depth = 0;
+static uint32_t max_children = 0;
+static set<string> include_types;
+static set<string> exclude_types;
+static set<string> exclude_fields;		/* ":field" or "TYPE:field" */
+static set<string> normalize_fields;	/* ":field" or "TYPE:field" */
+static uint32_t page_size = 0;
+static const char *cache_directory = NULL;
+static uint64_t cache_size = UINT64_C(1024) * 1024 * 1024;
+static string cache_options;		/* the options the pictures depend on */
+static const char *serve_socket = NULL;
+static volatile sig_atomic_t interrupted = 0;
+static const char *spool_directory = NULL;
 static bool remove_dot_files = false;
 static const char *color_map_filename = NULL;
 static const char *picture_format = NULL;
 static const char *img_directory = NULL;
 static const char *dot_directory = NULL;
+static int max_jobs = 1;
+static bool may_fork = true;		/* not in a job already */
+static stdout_mode_t stdout_mode = StdoutNone;
 
 static map<string, node_color_t> node_color_mapping;
 
+#ifdef HAVE_LIBGVC
+static GVC_t *gvc_context = NULL;
+static mutex gvc_lock;				/* Graphviz is not thread safe */
+#endif
+
+/*
+ * The fields that change from one execution of a query to another, or from
+ * one constant to another, while the plan stays the same.
+ */
+static const char *default_normalize_fields =
+	":location,:queryId,:plan_node_id,:stmt_location,:stmt_len,"
+	":startup_cost,:total_cost,:plan_rows,:plan_width,CONST:constvalue";
+
 static dot_color_map_t default_node_color_mapping[] = {
 	{ "QUERY",          { "skyblue",   "" } },
 	{ "PLANNEDSTMT",    { "pink",      "" } },
@@ -79,6 +576,32 @@ static dot_color_map_t default_node_color_mapping[] = {
 	{ NULL,             { "",          "" } }
 };
 
+/*
+ * The widths of the printable ASCII characters in Times-Roman and Times-Bold,
+ * from their Adobe font metrics, in 1/1000 em.
+ */
+static const uint16_t times_roman_widths[95] = {
+	250, 333, 408, 500, 500, 833, 778, 333, 333, 333, 500, 564,
+	250, 333, 250, 278, 500, 500, 500, 500, 500, 500, 500, 500,
+	500, 500, 278, 278, 564, 564, 564, 444, 921, 722, 667, 667,
+	722, 611, 556, 722, 722, 333, 389, 722, 611, 889, 722, 722,
+	556, 722, 667, 556, 611, 722, 722, 944, 722, 722, 611, 333,
+	278, 333, 469, 500, 333, 444, 500, 444, 500, 444, 333, 500,
+	500, 278, 278, 500, 278, 778, 500, 500, 500, 500, 333, 389,
+	278, 500, 500, 722, 500, 500, 444, 480, 200, 480, 541
+};
+
+static const uint16_t times_bold_widths[95] = {
+	250, 333, 555, 500, 500, 1000, 833, 333, 333, 333, 500, 570,
+	250, 333, 250, 278, 500, 500, 500, 500, 500, 500, 500, 500,
+	500, 500, 333, 333, 570, 570, 570, 500, 930, 722, 667, 722,
+	722, 667, 611, 778, 778, 389, 500, 778, 667, 944, 722, 778,
+	611, 778, 722, 556, 667, 722, 722, 1000, 722, 722, 667, 333,
+	278, 333, 581, 500, 333, 500, 556, 444, 556, 444, 333, 500,
+	556, 278, 333, 556, 278, 833, 556, 500, 556, 556, 444, 389,
+	333, 556, 500, 722, 500, 500, 444, 394, 220, 394, 520
+};
+
 
 /* private functions declaration */
 static const char *get_progname(const char *argv0);
@@ -93,39 +616,286 @@ static vector<string> split_node_colors(const string& str);
 static string ltrim(const string& str);
 static string rtrim(const string& str);
 static string trim(const string& str);
+static bool add_filters(const char *arg, bool include);
+static bool add_normalize_fields(const char *arg);
 
 static bool check_dot_program(void);
 
-static bool node2graph(const char *filename);
-static node_t *parse_pg_node_tree(FILE *fp);
-static string get_pg_node_name(FILE *fp);
+static bool open_input(const char *filename, input_t *input);
+static void close_input(input_t *input);
+static compression_t detect_compression(const char *data, size_t len);
+static compression_t get_file_compression(int fd);
+static const char *get_compression_name(compression_t compression);
+static bool open_decompressor(decompressor_t *dc, int fd,
+							  const string& head, compression_t compression,
+							  const char *filename);
+static void close_decompressor(decompressor_t *dc);
+static ssize_t read_decompressor(decompressor_t *dc, char *buf, size_t size);
+static void run_decompressor(decompressor_t *dc);
+#if defined(HAVE_ZLIB) || defined(HAVE_LIBZSTD) || defined(HAVE_LIBLZ4)
+static ssize_t read_compressed(decompressor_t *dc, char *buf, size_t size);
+static bool put_decompressed(decompressor_t *dc, string& chunk);
+#endif
+#ifdef HAVE_ZLIB
+static bool decompress_gzip(decompressor_t *dc);
+#endif
+#ifdef HAVE_LIBZSTD
+static bool decompress_zstd(decompressor_t *dc);
+#endif
+#ifdef HAVE_LIBLZ4
+static bool decompress_lz4(decompressor_t *dc);
+#endif
+
+static structural_mask_fn select_structural_mask(void);
+static uint64_t structural_mask_scalar(const char *block, size_t len);
+#ifdef __SSE2__
+static uint64_t structural_mask_sse2(const char *block);
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+static uint64_t structural_mask_avx2(const char *block);
+#endif
+static uint64_t scanner_load_block(const scanner_t *sc);
+static void scanner_init(scanner_t *sc, const char *begin, const char *end);
+static const char *scanner_next(scanner_t *sc);
+
+static void init_node_tree(node_tree_t *tree);
+static void free_node_tree(node_tree_t *tree);
+static uint32_t add_node(node_tree_t *tree, tag_t tag, const span_t& name);
+static void append_node(node_tree_t *tree, uint32_t parent, uint32_t node);
+static span_t get_node_name(const node_tree_t *tree, uint32_t node);
+static void merge_subtrees(node_tree_t *tree);
+static uint64_t hash_node(const node_tree_t *tree, uint32_t node,
+						  const vector<uint32_t>& klass);
+static bool same_node(const node_tree_t *tree, uint32_t a, uint32_t b,
+					  const vector<uint32_t>& klass);
+static uint32_t get_subtree_end(const node_tree_t *tree, uint32_t node);
+static bool is_merged_node(const node_tree_t *tree, uint32_t node);
+static bool hangs_from_prev(const node_tree_t *tree, uint32_t prev);
+static span_t get_trimmed_name(const node_tree_t *tree, uint32_t node);
+
+static bool process_files(char **filenames, int nfiles);
+static bool run_node2graph(void *arg);
+static bool serve(const char *path, int nthreads);
+static void run_server_worker(render_server_t *server);
+static void serve_client(int fd);
+static bool wait_client(int fd, short events, int64_t deadline);
+static bool send_client(int fd, const char *data, size_t len,
+						int64_t deadline);
+static int64_t get_clock_ms(void);
+static void catch_interrupts(void);
+static void handle_interrupt(int signo);
+static bool watch_directory(const char *dirname);
+static bool scan_watch_directory(watcher_t *watcher);
+static void watch_file(watcher_t *watcher, const char *name);
+static void forget_watched_files(watcher_t *watcher);
+static bool is_node_file(const char *name);
+
+static void init_job_pool(job_pool_t *pool, int njobs);
+static void start_job(job_pool_t *pool, const string& label,
+					  bool (*run)(void *), void *arg);
+static void wait_jobs(job_pool_t *pool, size_t max_running);
+static void reap_jobs(job_pool_t *pool);
+static void finish_job(job_pool_t *pool, pid_t pid, int status);
+static void report_job(job_pool_t *pool, const string& label, bool ok);
 
-static string get_dot_edge(size_t src_suffix, size_t src_index,
+static bool node2graph(const char *filename);
+static bool stream2graph(int fd, const char *source, const string& pathname);
+static const char *get_input_pathname(const char *filename);
+static int open_input_file(const char *filename);
+static bool write_dot_stdout(const node_tree_t *tree);
+static bool render_graph_native(const node_tree_t *tree,
+								const string& imgfile);
+static void layout_native_graph(const node_tree_t *tree,
+								native_layout_t *layout);
+static long merge_contours(contour_t *acc, contour_t *next);
+static void add_native_rows(const node_tree_t *tree, uint32_t node,
+							native_layout_t *layout, string& buf);
+static native_row_t *add_native_row(native_layout_t *layout, uint32_t index,
+									bool header);
+static void add_native_line(native_layout_t *layout, native_row_t *row,
+							const char *text, size_t len, bool bold,
+							native_align_t align, long span);
+static void add_native_colnames(native_layout_t *layout, native_row_t *row,
+								const string& name);
+static void finish_native_row(native_row_t *row);
+static long get_text_width(const char *text, size_t len, bool bold);
+static void write_native_svg(const node_tree_t *tree,
+							 const native_layout_t *layout, writer_t *w);
+static void write_native_arrow(writer_t *w, const char *id,
+							   const char *color);
+static void write_native_node(const node_tree_t *tree,
+							  const native_layout_t *layout, uint32_t node,
+							  string& buf, writer_t *w);
+static void write_native_edges(const node_tree_t *tree,
+							   const native_layout_t *layout, uint32_t node,
+							   writer_t *w);
+static void write_native_edge(const native_layout_t *layout, uint32_t src,
+							  uint32_t port, uint32_t dst, bool list,
+							  writer_t *w);
+static void put_svg_text(writer_t *w, const char *text, size_t len);
+static bool input2graph(const input_t *input, const char *source,
+						const string& pathname);
+
+static bool log2graph(const char *filename, job_pool_t *pool);
+static bool log2graph_parallel(const char *filename, job_pool_t *pool);
+static bool follow_log(const char *filename, job_pool_t *pool);
+static void scan_log_chunk(log_chunk_t *chunk);
+static const char *next_line(const char *p, const char *end, span_t *line);
+static void start_log_tree_job(job_pool_t *pool, log_tree_t *tree,
+							   size_t seq);
+static bool run_log_tree(void *arg);
+static void init_log_extractor(log_extractor_t *ex, const char *filename);
+static log_feed_t feed_log_extractor(log_extractor_t *ex,
+									 const span_t *line);
+static log_feed_t append_log_tree_line(log_extractor_t *ex,
+									   const char *line, size_t len);
+static string get_log_tree_pathname(const log_extractor_t *ex,
+									const char *prefix,
+									const char *prefix_end);
+
+static bool open_line_reader(const char *filename, line_reader_t *reader);
+static void close_line_reader(line_reader_t *reader);
+static bool read_line(line_reader_t *reader, span_t *line);
+static bool render_graph(const node_tree_t *tree, const string& dotfile,
+						 const string& imgfile);
+static bool render_picture(const node_tree_t *tree, const string& dotfile,
+						   const string& imgfile);
+static bool render_graph_cached(const node_tree_t *tree,
+								const string& dotfile,
+								const string& imgfile);
+static void init_cache_options(void);
+static string get_cache_key(const node_tree_t *tree);
+static bool copy_file(int fd, const string& dst);
+static void evict_cache(void);
+static bool render_graph_dot(const node_tree_t *tree,
+							 const graph_pages_t *pages, uint32_t page,
+							 const string& dotfile, const string& imgfile);
+static bool render_graph_pages(const node_tree_t *tree,
+							   const string& dotfile, const string& imgfile);
+static bool run_page_job(void *arg);
+static void split_graph(const node_tree_t *tree, graph_pages_t *pages);
+static string get_page_filename(const string& filename,
+								const string& suffix, uint32_t page);
+static bool write_page_index(const node_tree_t *tree,
+							 const graph_pages_t *pages,
+							 const string& indexfile);
+static bool render_graph_data(const node_tree_t *tree, const string& format,
+							  writer_t *out);
+#ifdef HAVE_LIBGVC
+static bool render_graph_libgvc(const node_tree_t *tree,
+								const graph_pages_t *pages, uint32_t page,
+								const string& dotfile,
+								const string& imgfile);
+static bool render_data_libgvc(const node_tree_t *tree,
+							   const string& format, writer_t *out);
+#else
+static bool render_graph_program(const node_tree_t *tree,
+								 const graph_pages_t *pages, uint32_t page,
+								 const string& dotfile,
+								 const string& imgfile);
+static bool render_data_program(const node_tree_t *tree,
+								const string& format, writer_t *out);
+static pid_t spawn_dot_program(const char *const argv[], int *stdin_fd,
+							   int *stdout_fd);
+static bool wait_dot_program(pid_t pid, const string& imgfile);
+#endif
+static bool parse_pg_node_tree(const input_t *input, node_tree_t *tree);
+static void init_node_parser(node_parser_t *parser, node_tree_t *tree);
+static parse_result_t feed_node_parser(node_parser_t *parser,
+									   const char *chunk, size_t len);
+static parse_result_t run_node_parser(node_parser_t *parser);
+static bool add_named_node(node_parser_t *parser, const span_t& name);
+static bool is_hidden_node(const node_parser_t *parser);
+static void hide_node(node_parser_t *parser, const span_t& name);
+static void skip_node(node_parser_t *parser);
+static bool is_filtered_node(node_parser_t *parser, const span_t& name);
+static bool is_filtered_field(node_parser_t *parser, const span_t& name);
+static bool match_field(node_parser_t *parser, const span_t& name,
+						const set<string>& fields);
+static void normalize_field(node_parser_t *parser, uint32_t node,
+							const span_t& name);
+static bool skip_node_token(node_parser_t *parser, const char *token);
+static span_t get_node_type(const char *p, const char *end);
+static void count_hidden_node(node_parser_t *parser, span_t type);
+static void add_placeholder(node_parser_t *parser);
+static const char *get_pg_node_name(scanner_t *sc, const char **resume);
+static size_t encode_pg_node_name(const span_t& name, char *buf, bool html);
+static void decode_pg_node_name(const span_t& name, string& buf);
+static void get_display_name(const span_t& name, string& buf);
+
+static void hasher_init(hasher_t *h);
+static void hasher_update(hasher_t *h, const void *data, size_t len);
+static uint64_t hasher_final(hasher_t *h);
+static uint64_t hasher_round(uint64_t acc, uint64_t input);
+static uint64_t read_uint64(const unsigned char *p);
+static uint32_t read_uint32(const unsigned char *p);
+
+static void writer_init(writer_t *w, int fd);
+static bool writer_flush(writer_t *w);
+static bool write_all(int fd, const char *data, size_t len);
+static void writer_free(writer_t *w);
+static char *writer_reserve(writer_t *w, size_t len);
+static void put_bytes(writer_t *w, const char *data, size_t len);
+static void put_string(writer_t *w, const string& str);
+static void put_uint(writer_t *w, uint64_t value);
+static void put_node_name(writer_t *w, const span_t& name);
+
+static void write_dot_edge(writer_t *w, size_t src_suffix, size_t src_index,
 						   size_t dst_suffix, size_t dst_index, bool list);
-static void write_dot_script(node_t *root, FILE *fp);
-static string get_dot_node_header(size_t suffix, const string& name);
-static string get_dot_node_body(size_t suffix, const string& name);
-static string get_dot_node_footer(void);
-static bool name_contains_empty(const string& name);
+static void write_dot_script(const node_tree_t *tree,
+							 const graph_pages_t *pages, uint32_t page,
+							 writer_t *w);
+static void write_page_stub(writer_t *w, const node_tree_t *tree,
+							const graph_pages_t *pages, size_t src_suffix,
+							size_t src_index, size_t dst_suffix, bool list,
+							bool out);
+static void write_dot_node_header(writer_t *w, size_t suffix,
+								  const string& name);
+static void write_dot_node_body(writer_t *w, size_t suffix,
+								const span_t& name, string& buf);
+static void write_dot_node_footer(writer_t *w);
+static bool name_contains_empty(const span_t& name);
 
 static string get_dot_filename(const string& pathname);
 static string get_img_filename(const string& pathname);
 
-static string format_colnames(const string& name);
+static void write_colnames(writer_t *w, const string& name);
+
+static structural_mask_fn structural_mask = select_structural_mask();
 
 
 int
 main(int argc, char **argv)
 {
 	int c;
-	const char *shortopts = "hvcD:I:n:rsT:";
+	bool ok;
+	bool jobs_set = false;
+	long value;
+	char *endptr;
+	const char *shortopts = "hvcD:fI:j:LMNn:O::rsT:";
 	struct option longopts[] = {
 		{ "help",           no_argument,        0, 'h' },
 		{ "version",        no_argument,        0, 'v' },
 		{ "color",          no_argument,        0, 'c' },
 		{ "dot-directory",  required_argument,  0, 'D' },
+		{ "follow",         no_argument,        0, 'f' },
 		{ "img-directory",  required_argument,  0, 'I' },
+		{ "jobs",           required_argument,  0, 'j' },
+		{ "server-log",     no_argument,        0, 'L' },
+		{ "merge-subtrees", no_argument,        0, 'M' },
+		{ "max-depth",      required_argument,  0, OptMaxDepth },
+		{ "max-children",   required_argument,  0, OptMaxChildren },
+		{ "include",        required_argument,  0, OptInclude },
+		{ "exclude",        required_argument,  0, OptExclude },
+		{ "page-size",      required_argument,  0, OptPageSize },
+		{ "cache-dir",      required_argument,  0, OptCacheDir },
+		{ "cache-size",     required_argument,  0, OptCacheSize },
+		{ "normalize",      optional_argument,  0, OptNormalize },
+		{ "serve",          required_argument,  0, OptServe },
+		{ "watch",          required_argument,  0, OptWatch },
+		{ "native",         no_argument,        0, 'N' },
 		{ "node-color-map", required_argument,  0, 'n' },
+		{ "stdout",         optional_argument,  0, 'O' },
 		{ "remove-dots",    no_argument,        0, 'r' },
 		{ "skip-empty",     no_argument,        0, 's' },
 		{ NULL,             required_argument,  0, 'T' },
@@ -134,6 +904,9 @@ main(int argc, char **argv)
 
 	progname = get_progname(argv[0]);
 
+	/* Writing to a dead dot program should fail, rather than kill us. */
+	signal(SIGPIPE, SIG_IGN);
+
 	while ((c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1) {
 		switch (c) {
 		case 'h':
@@ -148,12 +921,98 @@ main(int argc, char **argv)
 		case 'D':
 			dot_directory = optarg;
 			break;
+		case 'f':
+			enable_follow = true;
+			enable_server_log = true;
+			break;
 		case 'I':
 			img_directory = optarg;
 			break;
+		case 'j':
+			errno = 0;
+			value = strtol(optarg, &endptr, 10);
+			if (errno != 0 || *endptr != '\0' || endptr == optarg ||
+				value <= 0 || value > INT_MAX) {
+				write_stderr("%s: invalid number of jobs \"%s\"\n",
+							 progname, optarg);
+				exit(1);
+			}
+			max_jobs = value;
+			jobs_set = true;
+			break;
+		case 'L':
+			enable_server_log = true;
+			break;
+		case 'M':
+			enable_merge_subtrees = true;
+			break;
+		case OptMaxDepth:
+		case OptMaxChildren:
+		case OptPageSize:
+			errno = 0;
+			value = strtol(optarg, &endptr, 10);
+			if (errno != 0 || *endptr != '\0' || endptr == optarg ||
+				value <= 0 || value > INT_MAX) {
+				write_stderr("%s: invalid limit \"%s\"\n", progname, optarg);
+				exit(1);
+			}
+			if (c == OptMaxDepth) {
+				max_depth = value;
+			} else if (c == OptMaxChildren) {
+				max_children = value;
+			} else {
+				page_size = value;
+			}
+			break;
+		case OptCacheDir:
+			cache_directory = optarg;
+			break;
+		case OptServe:
+			serve_socket = optarg;
+			break;
+		case OptWatch:
+			spool_directory = optarg;
+			break;
+		case OptCacheSize:
+			errno = 0;
+			value = strtol(optarg, &endptr, 10);
+			if (errno != 0 || *endptr != '\0' || endptr == optarg ||
+				value <= 0 || value > INT_MAX) {
+				write_stderr("%s: invalid cache size \"%s\"\n",
+							 progname, optarg);
+				exit(1);
+			}
+			cache_size = (uint64_t) value * 1024 * 1024;
+			break;
+		case OptNormalize:
+			if (!add_normalize_fields(optarg != NULL ? optarg :
+									  default_normalize_fields)) {
+				exit(1);
+			}
+			break;
+		case OptInclude:
+		case OptExclude:
+			if (!add_filters(optarg, c == OptInclude)) {
+				exit(1);
+			}
+			break;
+		case 'N':
+			enable_native_layout = true;
+			break;
 		case 'n':
 			color_map_filename = optarg;
 			break;
+		case 'O':
+			if (optarg == NULL || strcmp(optarg, "picture") == 0) {
+				stdout_mode = StdoutPicture;
+			} else if (strcmp(optarg, "dot") == 0) {
+				stdout_mode = StdoutDot;
+			} else {
+				write_stderr("%s: invalid argument for --stdout \"%s\"\n",
+							 progname, optarg);
+				exit(1);
+			}
+			break;
 		case 'r':
 			remove_dot_files = true;
 			break;
@@ -169,32 +1028,104 @@ main(int argc, char **argv)
 		}
 	}
 
+	if (serve_socket != NULL &&
+		(argc - optind != 0 || enable_server_log || stdout_mode != StdoutNone ||
+		 page_size > 0 || cache_directory != NULL)) {
+		write_stderr("%s: --serve takes no files, and does not work with -L, --stdout, --page-size or --cache-dir\n",
+					 progname);
+		exit(1);
+	}
+
+	if (spool_directory != NULL &&
+		(argc - optind != 0 || enable_server_log || stdout_mode != StdoutNone ||
+		 serve_socket != NULL)) {
+		write_stderr("%s: --watch takes no files, and does not work with -L, --stdout or --serve\n",
+					 progname);
+		exit(1);
+	}
+
+	if (stdout_mode != StdoutNone) {
+		if (enable_server_log || argc - optind != 1) {
+			write_stderr("%s: --stdout needs exactly one node tree file\n",
+						 progname);
+			exit(1);
+		}
+
+		/* nothing else goes to stdout, and no files are written */
+		remove_dot_files = true;
+		max_jobs = 1;
+	}
+
+	if (page_size > 0 && (stdout_mode != StdoutNone || enable_native_layout)) {
+		write_stderr("%s: --page-size does not work with --stdout or --native\n",
+					 progname);
+		exit(1);
+	}
+
+	if (cache_directory != NULL &&
+		(stdout_mode != StdoutNone || page_size > 0)) {
+		write_stderr("%s: --cache-dir does not work with --stdout or --page-size\n",
+					 progname);
+		exit(1);
+	}
+
+	if (enable_follow && argc - optind != 1) {
+		write_stderr("%s: --follow needs exactly one server log\n", progname);
+		exit(1);
+	}
+
 	/* If we don't specify picture format, use png as default. */
 	if (picture_format == NULL) {
-		picture_format = "png";
+		picture_format = enable_native_layout ? "svg" : "png";
 	}
 
-	if (!load_color_map()) {
+	if (enable_native_layout && strcmp(picture_format, "svg") != 0) {
+		write_stderr("%s: --native only supports the svg format\n", progname);
 		exit(1);
 	}
 
-	/* check dot program */
-	if (!check_dot_program()) {
+	if (!load_color_map()) {
 		exit(1);
 	}
 
-	for (int i = optind; i < argc; i++) {
-
-		printf("processing \"%s\" ... ", argv[i]);
-		fflush(stdout);
-		if (node2graph(argv[i])) {
-			printf("ok\n");
-		} else {
-			printf("failed\n");
+	if (cache_directory != NULL) {
+		if (mkdir(cache_directory, 0777) != 0 && errno != EEXIST) {
+			write_stderr("%s: could not create directory \"%s\": %m\n",
+						 progname, cache_directory);
+			exit(1);
 		}
+		init_cache_options();
 	}
 
-	return 0;
+#ifdef HAVE_LIBGVC
+	/* render in process, no need for the dot program */
+	gvc_context = gvContext();
+	if (gvc_context == NULL) {
+		write_stderr("%s: could not create Graphviz context\n", progname);
+		exit(1);
+	}
+#else
+	/* check dot program, unless we do not need it */
+	if (stdout_mode != StdoutDot && !enable_native_layout &&
+		!check_dot_program()) {
+		exit(1);
+	}
+#endif
+
+	if (serve_socket != NULL) {
+		ok = serve(serve_socket, jobs_set ? max_jobs :
+				   max((int) thread::hardware_concurrency(), 1));
+	} else if (spool_directory != NULL) {
+		ok = watch_directory(spool_directory);
+	} else {
+		ok = process_files(argv + optind, argc - optind);
+	}
+
+#ifdef HAVE_LIBGVC
+	gvFreeContext(gvc_context);
+#endif
+
+	return ok ? 0 : 1;
 }
 
 
@@ -218,15 +1149,39 @@ usage(void)
 	printf("Convert PostgreSQL node tree into picture.\n");
 	printf("\nUsage:\n");
 	printf("  %s [OPTIONS] <filename>...\n", progname);
+	printf("  %s [OPTIONS] --serve=SOCKET\n", progname);
+	printf("  %s [OPTIONS] --watch=DIR\n", progname);
+	printf("\nWith \"-\" as the filename, read the standard input.\n");
 	printf("\nOptions:\n");
 	printf("  -h, --help           show this page and exit\n");
 	printf("  -v, --version        show version and exit\n");
 	printf("  -c, --color          render the output with color\n");
 	printf("  -D, --dot-directory  specify temporary dot files directory\n");
+	printf("  -f, --follow         keep reading a server log as it grows (implies -L)\n");
 	printf("  -I, --img-dorectory  specify output pictures directory\n");
+	printf("  -j, --jobs=N         process up to N files in parallel (default: 1)\n");
+	printf("  -L, --server-log     extract all node trees from PostgreSQL server logs\n");
+	printf("  -M, --merge-subtrees draw identical subtrees once\n");
+	printf("      --max-depth=N    hide the nodes deeper than N\n");
+	printf("      --max-children=N hide the elements of a list after the first N\n");
+	printf("      --include=TYPE,...\n"
+		   "                       show only the nodes of these types\n");
+	printf("      --exclude=TYPE,:FIELD,TYPE:FIELD,...\n"
+		   "                       leave out these nodes and fields\n");
+	printf("      --page-size=N    split graphs into pictures of at most N nodes\n");
+	printf("      --normalize[=:FIELD,TYPE:FIELD,...]\n"
+		   "                       hide the values of these fields (default: the\n"
+		   "                       locations, ids, costs and constants)\n");
+	printf("      --serve=SOCKET   render the node trees sent to a Unix socket, with\n"
+		   "                       -j threads (default: the number of CPUs)\n");
+	printf("      --watch=DIR      render the node tree files written into DIR\n");
+	printf("      --cache-dir=DIR  reuse the pictures of identical trees from DIR\n");
+	printf("      --cache-size=MB  keep at most MB megabytes in the cache (default: 1024)\n");
+	printf("  -N, --native         lay out the graph without Graphviz, write SVG\n");
 	printf("  -n, --node-color-map=NODE_COLOR_MAP\n"
 		   "                       specify the color mapping file (with -c option)\n");
-	printf("  -r, --remove-dots    remove temporary dot files\n");
+	printf("  -O, --stdout[=dot]   write the picture, or the dot script, to stdout\n");
+	printf("  -r, --remove-dots    do not keep dot files, pipe them to dot directly\n");
 	printf("  -s, --skip-empty     skip empty fields\n");
 	printf("  -T FORMAT            specify the format for the picture (default: png)\n");
 	printf("\nReport bugs to <japinli@hotmail.com>\n");
@@ -377,6 +1332,61 @@ trim(const string& str)
 	return ltrim(rtrim(str));
 }
 
+/*
+ * Add the comma separated node types of --include, or node types and fields
+ * of --exclude.
+ */
+static bool
+add_filters(const char *arg, bool include)
+{
+	vector<string> patterns = split_node_colors(arg);
+
+	for (size_t i = 0; i < patterns.size(); i++) {
+		const string& pattern = patterns[i];
+		size_t pos = pattern.find(':');
+
+		if (pattern.empty() || pos == pattern.size() - 1 ||
+			(include && pos != string::npos)) {
+			write_stderr("%s: invalid filter \"%s\"\n", progname, arg);
+			return false;
+		}
+
+		if (include) {
+			include_types.insert(pattern);
+		} else if (pos == string::npos) {
+			exclude_types.insert(pattern);
+		} else {
+			exclude_fields.insert(pattern);
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Add the fields of --normalize, ":field" or "TYPE:field".
+ */
+static bool
+add_normalize_fields(const char *arg)
+{
+	vector<string> patterns = split_node_colors(arg);
+
+	for (size_t i = 0; i < patterns.size(); i++) {
+		const string& pattern = patterns[i];
+		size_t pos = pattern.find(':');
+
+		if (pos == string::npos || pos == pattern.size() - 1) {
+			write_stderr("%s: invalid field \"%s\"\n", progname,
+						 pattern.c_str());
+			return false;
+		}
+
+		normalize_fields.insert(pattern);
+	}
+
+	return true;
+}
+
 /*
  * Check if the dot program exist or not.
  */
@@ -413,429 +1423,5716 @@ check_dot_program(void)
 	return true;
 }
 
+/*
+ * Load the content of the file into memory.
+ *
+ * Regular files are mapped read-only, so the parser can work on the page
+ * cache directly.  For anything we cannot map, fall back to reading the
+ * file in large blocks.
+ */
 static bool
-node2graph(const char *filename)
+open_input(const char *filename, input_t *input)
 {
-	FILE *infp = NULL;
-	FILE *dotfp = NULL;
-	string dotfile = get_dot_filename(filename);
-	string imgfile = get_img_filename(filename);
-	string dotcmd;
-	node_t *root;
+	int fd;
+	struct stat st;
+	char *buf = NULL;
+	size_t size = 0;
+	size_t capacity = 0;
+	ssize_t nread;
 
-	infp = fopen(filename, "r");
-	if (infp == NULL) {
-		write_stderr("%s: could not open file \"%s\" for reading: %m\n",
-					 progname, filename);
-		goto failed;
-	}
+	input->data = NULL;
+	input->size = 0;
+	input->mapped = false;
 
-	dotfp = fopen(dotfile.c_str(), "w");
-	if (dotfp == NULL) {
-		write_stderr("%s: could not open file \"%s\" for writing: %m\n",
-					 progname, dotfile.c_str());
-		goto failed;
+	fd = open_input_file(filename);
+	if (fd < 0) {
+		return false;
 	}
 
-	root = parse_pg_node_tree(infp);
-	if (root == NULL) {
-		write_stderr("%s: could no parse node tree from file \"%s\"\n",
+	if (fstat(fd, &st) != 0) {
+		write_stderr("%s: could not stat file \"%s\": %m\n",
 					 progname, filename);
-		goto failed;
+		close(fd);
+		return false;
 	}
 
-	write_dot_script(root, dotfp);
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 
-	/* convert dot to image */
-	dotcmd = "dot -T " + string(picture_format);
-	dotcmd += " -o " + imgfile + " " + dotfile;
+		if (addr != MAP_FAILED) {
+			/* We only scan forward, tell the kernel to read ahead. */
+			madvise(addr, st.st_size, MADV_SEQUENTIAL);
 
-	if (system(dotcmd.c_str()) != 0) {
-		write_stderr("%s: could not execute command \"%s\"\n",
-					 progname, dotcmd.c_str());
-		goto failed;
+			input->data = (const char *) addr;
+			input->size = st.st_size;
+			input->mapped = true;
+			close(fd);
+			return true;
+		}
 	}
 
- failed:
+	/* Cannot map it, read it in large blocks. */
+	for (;;) {
+		if (size == capacity) {
+			char *tmp;
+
+			capacity = capacity == 0 ? 1024 * 1024 : capacity * 2;
+			tmp = (char *) realloc(buf, capacity);
+			if (tmp == NULL) {
+				write_stderr("%s: out of memory\n", progname);
+				free(buf);
+				close(fd);
+				return false;
+			}
+			buf = tmp;
+		}
 
-	if (remove_dot_files) {
-		unlink(dotfile.c_str());
-	}
+		nread = read(fd, buf + size, capacity - size);
+		if (nread < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			write_stderr("%s: could not read file \"%s\": %m\n",
+						 progname, filename);
+			free(buf);
+			close(fd);
+			return false;
+		}
 
-	if (infp != NULL) {
-		fclose(infp);
-	}
-	if (dotfp != NULL) {
-		fclose(dotfp);
+		if (nread == 0) {
+			break;
+		}
+		size += nread;
 	}
 
+	close(fd);
+
+	input->data = buf;
+	input->size = size;
 	return true;
 }
 
-static node_t *
-parse_pg_node_tree(FILE *fp)
+static void
+close_input(input_t *input)
+{
+	if (input->mapped) {
+		munmap((void *) input->data, input->size);
+	} else {
+		free((void *) input->data);
+	}
+
+	input->data = NULL;
+	input->size = 0;
+	input->mapped = false;
+}
+
+/*
+ * Recognize a compressed input from its first bytes.
+ */
+static compression_t
+detect_compression(const char *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) data;
+
+	if (len >= 2 && p[0] == 0x1f && p[1] == 0x8b) {
+		return CompressGzip;
+	}
+
+	if (len >= 4 && p[0] == 0x28 && p[1] == 0xb5 && p[2] == 0x2f &&
+		p[3] == 0xfd) {
+		return CompressZstd;
+	}
+
+	if (len >= 4 && p[0] == 0x04 && p[1] == 0x22 && p[2] == 0x4d &&
+		p[3] == 0x18) {
+		return CompressLz4;
+	}
+
+	return CompressNone;
+}
+
+/*
+ * Peek at the first bytes of a file, without moving its offset.  Anything
+ * we cannot peek at, such as a pipe, is taken as uncompressed.
+ */
+static compression_t
+get_file_compression(int fd)
+{
+	char magic[4];
+	ssize_t nread = pread(fd, magic, sizeof(magic), 0);
+
+	if (nread <= 0) {
+		return CompressNone;
+	}
+
+	return detect_compression(magic, nread);
+}
+
+static const char *
+get_compression_name(compression_t compression)
+{
+	switch (compression) {
+	case CompressGzip:
+		return "gzip";
+	case CompressZstd:
+		return "zstd";
+	case CompressLz4:
+		return "lz4";
+	default:
+		return "none";
+	}
+}
+
+/*
+ * Start decompressing fd in a child process, after head, which has been
+ * read from fd already.  The fd must stay open until close_decompressor().
+ */
+static bool
+open_decompressor(decompressor_t *dc, int fd, const string& head,
+				  compression_t compression, const char *filename)
+{
+	bool supported = false;
+	int data_fds[2];
+	int status_fds[2];
+
+	switch (compression) {
+#ifdef HAVE_ZLIB
+	case CompressGzip:
+		supported = true;
+		break;
+#endif
+#ifdef HAVE_LIBZSTD
+	case CompressZstd:
+		supported = true;
+		break;
+#endif
+#ifdef HAVE_LIBLZ4
+	case CompressLz4:
+		supported = true;
+		break;
+#endif
+	default:
+		break;
+	}
+
+	if (!supported) {
+		write_stderr("%s: could not read \"%s\": %s compression is not supported by this build\n",
+					 progname, filename, get_compression_name(compression));
+		return false;
+	}
+
+	if (pipe2(data_fds, O_CLOEXEC) != 0) {
+		write_stderr("%s: could not create pipe: %m\n", progname);
+		return false;
+	}
+	if (pipe2(status_fds, O_CLOEXEC) != 0) {
+		write_stderr("%s: could not create pipe: %m\n", progname);
+		close(data_fds[0]);
+		close(data_fds[1]);
+		return false;
+	}
+
+	/* fewer round trips, if we may */
+	fcntl(data_fds[1], F_SETPIPE_SZ, DECOMPRESS_CHUNK_SIZE);
+
+	dc->fd = fd;
+	dc->head = head;
+	dc->filename = filename;
+	dc->compression = compression;
+	dc->done = false;
+	dc->failed = false;
+
+	/* do not let the child flush our buffered output again */
+	fflush(NULL);
+
+	dc->pid = fork();
+	if (dc->pid < 0) {
+		write_stderr("%s: could not fork: %m\n", progname);
+		close(data_fds[0]);
+		close(data_fds[1]);
+		close(status_fds[0]);
+		close(status_fds[1]);
+		return false;
+	}
+
+	if (dc->pid == 0) {
+		close(data_fds[0]);
+		close(status_fds[0]);
+		dc->data_fd = data_fds[1];
+		dc->status_fd = status_fds[1];
+		run_decompressor(dc);
+	}
+
+	close(data_fds[1]);
+	close(status_fds[1]);
+	dc->data_fd = data_fds[0];
+	dc->status_fd = status_fds[0];
+	dc->head.clear();
+
+	return true;
+}
+
+/*
+ * Stop the child, even if the input has not been read to the end: it gets
+ * EPIPE once no process holds the pipe any more.
+ */
+static void
+close_decompressor(decompressor_t *dc)
+{
+	close(dc->data_fd);
+	close(dc->status_fd);
+
+	/* unless a job pool got it already */
+	while (waitpid(dc->pid, NULL, 0) < 0 && errno == EINTR) {
+		continue;
+	}
+}
+
+/*
+ * Read the decompressed input like read(2): return the number of bytes
+ * read, 0 at the end of the input, or -1 if decompression failed, which
+ * has been reported already.
+ */
+static ssize_t
+read_decompressor(decompressor_t *dc, char *buf, size_t size)
+{
+	while (!dc->done) {
+		ssize_t nread = read(dc->data_fd, buf, size);
+		char status;
+
+		if (nread > 0) {
+			return nread;
+		}
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nread < 0) {
+			write_stderr("%s: could not read decompressed \"%s\": %m\n",
+						 progname, dc->filename);
+			dc->failed = true;
+			break;
+		}
+
+		/* the child has closed the pipe, did it finish? */
+		while ((nread = read(dc->status_fd, &status, 1)) < 0 &&
+			   errno == EINTR) {
+			continue;
+		}
+
+		dc->done = true;
+		dc->failed = nread != 1;
+	}
+
+	if (dc->failed) {
+		errno = EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * The child process, which never returns.  The errors are reported here.
+ */
+static void
+run_decompressor(decompressor_t *dc)
+{
+	bool ok = false;
+
+	switch (dc->compression) {
+#ifdef HAVE_ZLIB
+	case CompressGzip:
+		ok = decompress_gzip(dc);
+		break;
+#endif
+#ifdef HAVE_LIBZSTD
+	case CompressZstd:
+		ok = decompress_zstd(dc);
+		break;
+#endif
+#ifdef HAVE_LIBLZ4
+	case CompressLz4:
+		ok = decompress_lz4(dc);
+		break;
+#endif
+	default:
+		break;
+	}
+
+	if (ok) {
+		ok = write_all(dc->status_fd, "", 1);
+	}
+
+	_exit(ok ? 0 : 1);
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_LIBZSTD) || defined(HAVE_LIBLZ4)
+/*
+ * Read the compressed input, return -1 on error.
+ */
+static ssize_t
+read_compressed(decompressor_t *dc, char *buf, size_t size)
+{
+	if (!dc->head.empty()) {
+		size_t len = min(size, dc->head.size());
+
+		memcpy(buf, dc->head.data(), len);
+		dc->head.erase(0, len);
+		return len;
+	}
+
+	for (;;) {
+		ssize_t nread = read(dc->fd, buf, size);
+
+		if (nread >= 0) {
+			return nread;
+		}
+
+		if (errno != EINTR) {
+			write_stderr("%s: could not read file \"%s\": %m\n",
+						 progname, dc->filename);
+			return -1;
+		}
+	}
+}
+
+/*
+ * Hand a decompressed chunk over to the reader, wait while the pipe is
+ * full.  Return false if the reader is gone.
+ */
+static bool
+put_decompressed(decompressor_t *dc, string& chunk)
+{
+	bool ok = write_all(dc->data_fd, chunk.data(), chunk.size());
+
+	chunk.clear();
+
+	return ok;
+}
+#endif
+
+#ifdef HAVE_ZLIB
+/*
+ * Decompress gzip data, which may be several gzip members one after
+ * another, as "cat a.gz b.gz" gives.
+ */
+static bool
+decompress_gzip(decompressor_t *dc)
+{
+	vector<char> in(DECOMPRESS_CHUNK_SIZE);
+	string out;
+	z_stream zs;
+	int rc;
+	bool flushed = true;	/* no output is pending in zlib */
+	bool ended = false;		/* a member is complete, all its output too */
+	bool ok = false;
+
+	memset(&zs, 0, sizeof(zs));
+
+	/* 32 lets zlib parse the gzip header */
+	if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+		write_stderr("%s: could not initialize zlib for \"%s\"\n",
+					 progname, dc->filename);
+		return false;
+	}
+
+	for (;;) {
+		if (zs.avail_in == 0 && (flushed || ended)) {
+			ssize_t nread = read_compressed(dc, in.data(), in.size());
+
+			if (nread < 0) {
+				break;
+			}
+
+			if (nread == 0) {
+				if (ended) {
+					ok = true;
+				} else {
+					write_stderr("%s: unexpected end of gzip data in \"%s\"\n",
+								 progname, dc->filename);
+				}
+				break;
+			}
+
+			zs.next_in = (Bytef *) in.data();
+			zs.avail_in = nread;
+		}
+
+		/* another member follows */
+		if (ended) {
+			inflateReset(&zs);
+			ended = false;
+		}
+
+		out.resize(DECOMPRESS_CHUNK_SIZE);
+		zs.next_out = (Bytef *) &out[0];
+		zs.avail_out = out.size();
+
+		rc = inflate(&zs, Z_NO_FLUSH);
+		if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+			write_stderr("%s: could not decompress \"%s\": %s\n",
+						 progname, dc->filename,
+						 zs.msg != NULL ? zs.msg : "corrupt gzip data");
+			break;
+		}
+
+		ended = rc == Z_STREAM_END;
+		flushed = zs.avail_out != 0;
+		out.resize(out.size() - zs.avail_out);
+
+		if (!out.empty() && !put_decompressed(dc, out)) {
+			ok = true;
+			break;
+		}
+	}
+
+	inflateEnd(&zs);
+
+	return ok;
+}
+#endif
+
+#ifdef HAVE_LIBZSTD
+/*
+ * Decompress zstd data, the stream decoder goes on to the next frame by
+ * itself.
+ */
+static bool
+decompress_zstd(decompressor_t *dc)
+{
+	vector<char> in(DECOMPRESS_CHUNK_SIZE);
+	string out;
+	ZSTD_DStream *zds;
+	ZSTD_inBuffer zin = { in.data(), 0, 0 };
+	size_t rc = 0;
+	bool flushed = true;	/* no output is pending in zstd */
+	bool ok = false;
+
+	zds = ZSTD_createDStream();
+	if (zds == NULL || ZSTD_isError(ZSTD_initDStream(zds))) {
+		write_stderr("%s: could not initialize zstd for \"%s\"\n",
+					 progname, dc->filename);
+		ZSTD_freeDStream(zds);
+		return false;
+	}
+
+	for (;;) {
+		ZSTD_outBuffer zout;
+
+		if (zin.pos == zin.size && flushed) {
+			ssize_t nread = read_compressed(dc, in.data(), in.size());
+
+			if (nread < 0) {
+				break;
+			}
+
+			if (nread == 0) {
+				/* 0 means that a frame is complete */
+				if (rc == 0) {
+					ok = true;
+				} else {
+					write_stderr("%s: unexpected end of zstd data in \"%s\"\n",
+								 progname, dc->filename);
+				}
+				break;
+			}
+
+			zin.size = nread;
+			zin.pos = 0;
+		}
+
+		out.resize(DECOMPRESS_CHUNK_SIZE);
+		zout.dst = &out[0];
+		zout.size = out.size();
+		zout.pos = 0;
+
+		rc = ZSTD_decompressStream(zds, &zout, &zin);
+		if (ZSTD_isError(rc)) {
+			write_stderr("%s: could not decompress \"%s\": %s\n",
+						 progname, dc->filename, ZSTD_getErrorName(rc));
+			break;
+		}
+
+		flushed = zout.pos < zout.size;
+		out.resize(zout.pos);
+
+		if (!out.empty() && !put_decompressed(dc, out)) {
+			ok = true;
+			break;
+		}
+	}
+
+	ZSTD_freeDStream(zds);
+
+	return ok;
+}
+#endif
+
+#ifdef HAVE_LIBLZ4
+/*
+ * Decompress lz4 frames, the context goes on to the next frame once a
+ * frame is complete.
+ */
+static bool
+decompress_lz4(decompressor_t *dc)
+{
+	vector<char> in(DECOMPRESS_CHUNK_SIZE);
+	string out;
+	LZ4F_dctx *dctx;
+	size_t inpos = 0;
+	size_t insize = 0;
+	size_t hint = 0;
+	bool flushed = true;	/* no output is pending in lz4 */
+	bool ok = false;
+
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+		write_stderr("%s: could not initialize lz4 for \"%s\"\n",
+					 progname, dc->filename);
+		return false;
+	}
+
+	for (;;) {
+		size_t srclen;
+		size_t dstlen;
+
+		if (inpos == insize && flushed) {
+			ssize_t nread = read_compressed(dc, in.data(), in.size());
+
+			if (nread < 0) {
+				break;
+			}
+
+			if (nread == 0) {
+				/* 0 means that a frame is complete */
+				if (hint == 0) {
+					ok = true;
+				} else {
+					write_stderr("%s: unexpected end of lz4 data in \"%s\"\n",
+								 progname, dc->filename);
+				}
+				break;
+			}
+
+			inpos = 0;
+			insize = nread;
+		}
+
+		out.resize(DECOMPRESS_CHUNK_SIZE);
+		srclen = insize - inpos;
+		dstlen = out.size();
+
+		hint = LZ4F_decompress(dctx, &out[0], &dstlen, in.data() + inpos,
+							   &srclen, NULL);
+		if (LZ4F_isError(hint)) {
+			write_stderr("%s: could not decompress \"%s\": %s\n",
+						 progname, dc->filename, LZ4F_getErrorName(hint));
+			break;
+		}
+
+		inpos += srclen;
+		flushed = dstlen < out.size();
+		out.resize(dstlen);
+
+		if (!out.empty() && !put_decompressed(dc, out)) {
+			ok = true;
+			break;
+		}
+	}
+
+	LZ4F_freeDecompressionContext(dctx);
+
+	return ok;
+}
+#endif
+
+/*
+ * Choose the fastest structural character classifier the CPU supports.
+ * Return NULL if there is no vectorized one, in which case the scanner
+ * falls back to structural_mask_scalar().
+ */
+static structural_mask_fn
+select_structural_mask(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return structural_mask_avx2;
+	}
+#endif
+
+#ifdef __SSE2__
+	return structural_mask_sse2;
+#else
+	return NULL;
+#endif
+}
+
+static uint64_t
+structural_mask_scalar(const char *block, size_t len)
+{
+	uint64_t mask = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		switch (block[i]) {
+		case '{':
+		case '}':
+		case '(':
+		case ')':
+		case ':':
+			mask |= (uint64_t) 1 << i;
+			break;
+		default:
+			break;
+		}
+	}
+
+	return mask;
+}
+
+#ifdef __SSE2__
+static uint64_t
+structural_mask_sse2(const char *block)
+{
+	const __m128i lbrace = _mm_set1_epi8('{');
+	const __m128i rbrace = _mm_set1_epi8('}');
+	const __m128i lparen = _mm_set1_epi8('(');
+	const __m128i rparen = _mm_set1_epi8(')');
+	const __m128i colon = _mm_set1_epi8(':');
+	uint64_t mask = 0;
+
+	for (int i = 0; i < SCAN_BLOCK_SIZE; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (block + i));
+		__m128i m;
+
+		m = _mm_or_si128(_mm_cmpeq_epi8(v, lbrace), _mm_cmpeq_epi8(v, rbrace));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, lparen));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, rparen));
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(v, colon));
+
+		mask |= (uint64_t) (uint16_t) _mm_movemask_epi8(m) << i;
+	}
+
+	return mask;
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2")))
+static uint64_t
+structural_mask_avx2(const char *block)
+{
+	const __m256i lbrace = _mm256_set1_epi8('{');
+	const __m256i rbrace = _mm256_set1_epi8('}');
+	const __m256i lparen = _mm256_set1_epi8('(');
+	const __m256i rparen = _mm256_set1_epi8(')');
+	const __m256i colon = _mm256_set1_epi8(':');
+	uint64_t mask = 0;
+
+	for (int i = 0; i < SCAN_BLOCK_SIZE; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (block + i));
+		__m256i m;
+
+		m = _mm256_or_si256(_mm256_cmpeq_epi8(v, lbrace),
+							_mm256_cmpeq_epi8(v, rbrace));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, lparen));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, rparen));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, colon));
+
+		mask |= (uint64_t) (uint32_t) _mm256_movemask_epi8(m) << i;
+	}
+
+	return mask;
+}
+#endif
+
+/*
+ * Classify the block starting at sc->block.  The last block of the input
+ * is usually partial, we must not read past the end of the input, so it
+ * always goes through the scalar path.
+ */
+static uint64_t
+scanner_load_block(const scanner_t *sc)
+{
+	size_t left = sc->end - sc->block;
+
+	if (left >= SCAN_BLOCK_SIZE && structural_mask != NULL) {
+		return structural_mask(sc->block);
+	}
+
+	if (left > SCAN_BLOCK_SIZE) {
+		left = SCAN_BLOCK_SIZE;
+	}
+
+	return structural_mask_scalar(sc->block, left);
+}
+
+static void
+scanner_init(scanner_t *sc, const char *begin, const char *end)
+{
+	sc->block = begin;
+	sc->end = end;
+	sc->mask = begin < end ? scanner_load_block(sc) : 0;
+}
+
+/*
+ * Return the position of the next structural character, or NULL if we
+ * reach the end of the input.
+ */
+static const char *
+scanner_next(scanner_t *sc)
+{
+	while (sc->mask == 0) {
+		sc->block += SCAN_BLOCK_SIZE;
+		if (sc->block >= sc->end) {
+			sc->block = sc->end;
+			return NULL;
+		}
+		sc->mask = scanner_load_block(sc);
+	}
+
+	int offset = __builtin_ctzll(sc->mask);
+
+	/* clear the lowest set bit */
+	sc->mask &= sc->mask - 1;
+
+	return sc->block + offset;
+}
+
+/*
+ * Convert all the files into pictures, return false if any of them failed.
+ */
+static bool
+process_files(char **filenames, int nfiles)
+{
+	job_pool_t pool;
+
+	/* a single graph keeps the jobs for its pages */
+	if (nfiles == 1 && !enable_follow && !enable_server_log) {
+		init_job_pool(&pool, 1);
+	} else {
+		init_job_pool(&pool, max_jobs);
+	}
+
+	for (int i = 0; i < nfiles; i++) {
+		if (enable_follow) {
+			if (!follow_log(filenames[i], &pool)) {
+				pool.nfailed++;
+			}
+		} else if (enable_server_log) {
+			if (!log2graph(filenames[i], &pool)) {
+				pool.nfailed++;
+			}
+		} else {
+			start_job(&pool, filenames[i], run_node2graph, filenames[i]);
+		}
+	}
+
+	wait_jobs(&pool, 0);
+
+	return pool.nfailed == 0;
+}
+
+static bool
+run_node2graph(void *arg)
+{
+	return node2graph((const char *) arg);
+}
+
+static void
+init_job_pool(job_pool_t *pool, int njobs)
+{
+	pool->max_jobs = njobs;
+	pool->nfailed = 0;
+	pool->quiet = false;
+	pool->running.clear();
+	pool->succeeded = NULL;
+}
+
+/*
+ * Run a job, which converts something called label into a picture.
+ *
+ * With a single job, it runs right here, and we print the progress as
+ * before.  Otherwise, it runs in a child process, we wait until there is
+ * a free slot for it.  Graphviz is not thread-safe, and the layout is where
+ * the time goes, so processes let us lay out graphs in parallel whether we
+ * use libgvc or the dot program.
+ */
+static void
+start_job(job_pool_t *pool, const string& label, bool (*run)(void *),
+		  void *arg)
+{
+	pid_t pid;
+
+	/*
+	 * The picture goes to stdout, do not mix the progress into it.  The
+	 * pages of a graph are a part of its job, they are not reported either.
+	 */
+	if (stdout_mode != StdoutNone || (pool->quiet && pool->max_jobs <= 1)) {
+		if (!run(arg)) {
+			pool->nfailed++;
+		} else if (pool->succeeded != NULL) {
+			pool->succeeded->push_back(label);
+		}
+		return;
+	}
+
+	if (pool->max_jobs <= 1) {
+		printf("processing \"%s\" ... ", label.c_str());
+		fflush(stdout);
+		if (run(arg)) {
+			printf("ok\n");
+			if (pool->succeeded != NULL) {
+				pool->succeeded->push_back(label);
+			}
+		} else {
+			printf("failed\n");
+			pool->nfailed++;
+		}
+		fflush(stdout);
+		return;
+	}
+
+	wait_jobs(pool, pool->max_jobs - 1);
+
+	/* do not let the child flush our buffered output again */
+	fflush(NULL);
+
+	pid = fork();
+	if (pid < 0) {
+		write_stderr("%s: could not fork: %m\n", progname);
+		report_job(pool, label, false);
+		return;
+	}
+
+	if (pid == 0) {
+		bool ok;
+
+		/* a pool in here would run max_jobs more processes for each job */
+		may_fork = false;
+		ok = run(arg);
+
+		fflush(NULL);
+		_exit(ok ? 0 : 1);
+	}
+
+	pool->running[pid] = label;
+}
+
+/*
+ * Wait until at most max_running jobs are still running.
+ */
+static void
+wait_jobs(job_pool_t *pool, size_t max_running)
+{
+	while (pool->running.size() > max_running) {
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+
+		if (pid < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			write_stderr("%s: could not wait for child process: %m\n",
+						 progname);
+			exit(1);
+		}
+
+		finish_job(pool, pid, status);
+	}
+}
+
+/*
+ * Report the jobs that have finished, without waiting for the others.
+ */
+static void
+reap_jobs(job_pool_t *pool)
+{
+	while (!pool->running.empty()) {
+		int status;
+		pid_t pid = waitpid(-1, &status, WNOHANG);
+
+		if (pid < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (pid <= 0) {
+			break;
+		}
+
+		finish_job(pool, pid, status);
+	}
+}
+
+static void
+finish_job(job_pool_t *pool, pid_t pid, int status)
+{
+	auto it = pool->running.find(pid);
+
+	if (it == pool->running.end()) {
+		return;
+	}
+
+	report_job(pool, it->second,
+			   WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	pool->running.erase(it);
+}
+
+/*
+ * The jobs finish in any order, so print the whole line at once.
+ */
+static void
+report_job(job_pool_t *pool, const string& label, bool ok)
+{
+	if (ok && pool->succeeded != NULL) {
+		pool->succeeded->push_back(label);
+	}
+
+	if (pool->quiet) {
+		if (!ok) {
+			pool->nfailed++;
+		}
+		return;
+	}
+
+	printf("processing \"%s\" ... %s\n", label.c_str(), ok ? "ok" : "failed");
+	fflush(stdout);
+
+	if (!ok) {
+		pool->nfailed++;
+	}
+}
+
+/*
+ * Serve render requests on a Unix socket until SIGINT or SIGTERM, so the
+ * color map, the dot program check and the Graphviz context are paid once
+ * rather than for each tree.
+ *
+ * A client sends the format on the first line ("dot", "svg", "png" and so
+ * on, or an empty line for -T), then the node tree.  The answer is
+ * "ok LENGTH" and the picture, or "error MESSAGE", on a line.
+ */
+static bool
+serve(const char *path, int nthreads)
+{
+	render_server_t server;
+	struct sockaddr_un addr;
+	struct stat st;
+	sigset_t sigmask;
+	sigset_t oldmask;
+	vector<thread> workers;
+	bool ok = true;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		write_stderr("%s: socket path \"%s\" is too long\n", progname, path);
+		return false;
+	}
+
+	server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+							  SOCK_CLOEXEC, 0);
+	if (server.listen_fd < 0) {
+		write_stderr("%s: could not create socket: %m\n", progname);
+		return false;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/*
+	 * A socket left behind by a server that is gone refuses connections,
+	 * and we take its place.  One that accepts them is still served.
+	 */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		int probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		int rc = -1;
+
+		if (probe_fd >= 0) {
+			rc = connect(probe_fd, (struct sockaddr *) &addr, sizeof(addr));
+			if (rc != 0 && errno == ECONNREFUSED) {
+				unlink(path);
+			}
+			close(probe_fd);
+		}
+
+		if (rc == 0) {
+			write_stderr("%s: could not listen on \"%s\": address in use\n",
+						 progname, path);
+			close(server.listen_fd);
+			return false;
+		}
+	}
+
+	if (bind(server.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+		listen(server.listen_fd, SOMAXCONN) != 0) {
+		write_stderr("%s: could not listen on \"%s\": %m\n", progname, path);
+		close(server.listen_fd);
+		return false;
+	}
+
+	catch_interrupts();
+
+	/*
+	 * The workers inherit the blocked signals, so they go to the main
+	 * thread, and there they are only unblocked inside ppoll(), so one that
+	 * comes after the check of interrupted still wakes us up.
+	 */
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigmask, &oldmask);
+
+	server.stop = false;
+	for (int i = 0; i < nthreads; i++) {
+		workers.push_back(thread(run_server_worker, &server));
+	}
+
+	while (!interrupted) {
+		struct pollfd pfd;
+		int fd;
+
+		pfd.fd = server.listen_fd;
+		pfd.events = POLLIN;
+		if (ppoll(&pfd, 1, NULL, &oldmask) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			write_stderr("%s: could not poll socket: %m\n", progname);
+			ok = false;
+			break;
+		}
+
+		fd = accept4(server.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			write_stderr("%s: could not accept connection: %m\n", progname);
+			ok = false;
+			break;
+		}
+
+		lock_guard<mutex> guard(server.lock);
+		server.clients.push_back(fd);
+		server.changed.notify_one();
+	}
+
+	/* serve the clients accepted already, then stop */
+	{
+		lock_guard<mutex> guard(server.lock);
+		server.stop = true;
+		server.changed.notify_all();
+	}
+
+	for (size_t i = 0; i < workers.size(); i++) {
+		workers[i].join();
+	}
+
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+	close(server.listen_fd);
+	unlink(path);
+
+	return ok;
+}
+
+static void
+run_server_worker(render_server_t *server)
+{
+	for (;;) {
+		int fd;
+
+		{
+			unique_lock<mutex> guard(server->lock);
+
+			while (server->clients.empty() && !server->stop) {
+				server->changed.wait(guard);
+			}
+
+			if (server->clients.empty()) {
+				return;
+			}
+
+			fd = server->clients.front();
+			server->clients.pop_front();
+		}
+
+		serve_client(fd);
+		close(fd);
+	}
+}
+
+/*
+ * Read a request from a client, and answer it.  The tree is parsed as it
+ * arrives.  A client has SERVE_TIMEOUT in all to send its request, and
+ * again to read the answer, however it trickles, and a request may not
+ * be bigger than SERVE_REQUEST_MAX, so no client holds a worker or the
+ * memory for long.
+ */
+static void
+serve_client(int fd)
+{
+	vector<char> buf(DECOMPRESS_CHUNK_SIZE);
+	node_parser_t parser;
+	node_tree_t tree;
+	writer_t out;
+	string format;
+	parse_result_t rc = ParseNeedMore;
+	const char *error = NULL;
+	bool have_format = false;
+	size_t total = 0;
+	int64_t deadline;
+	char header[64];
+	int len;
+
+	/* we wait with poll(2), up to the deadline */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	deadline = get_clock_ms() + SERVE_TIMEOUT * 1000;
+
+	init_node_tree(&tree);
+	init_node_parser(&parser, &tree);
+	writer_init(&out, -1);
+
+	while (rc == ParseNeedMore) {
+		const char *data = buf.data();
+		ssize_t nread = read(fd, buf.data(), buf.size());
+		size_t size;
+
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nread < 0 && errno == EAGAIN) {
+			if (!wait_client(fd, POLLIN, deadline)) {
+				break;
+			}
+			continue;
+		}
+		if (nread <= 0) {
+			break;
+		}
+		size = nread;
+
+		total += size;
+		if (total > SERVE_REQUEST_MAX) {
+			error = "request too large";
+			break;
+		}
+
+		/* the first line is the format */
+		if (!have_format) {
+			const char *eol = (const char *) memchr(data, '\n', size);
+
+			format.append(data, eol != NULL ? eol - data : size);
+			if (format.size() > SERVE_FORMAT_MAX) {
+				break;
+			}
+			if (eol == NULL) {
+				continue;
+			}
+
+			have_format = true;
+			size -= eol + 1 - data;
+			data = eol + 1;
+		}
+
+		if (size > 0) {
+			rc = feed_node_parser(&parser, data, size);
+		}
+	}
+
+	format = trim(format);
+	if (format.empty()) {
+		format = picture_format;
+	}
+
+	if (error != NULL) {
+		/* already known */
+	} else if (!have_format) {
+		error = "could not read format";
+	} else if (rc != ParseComplete) {
+		error = "could not parse node tree";
+	} else {
+		if (enable_merge_subtrees) {
+			merge_subtrees(&tree);
+		}
+
+		if (!render_graph_data(&tree, format, &out)) {
+			error = "could not render graph";
+		}
+	}
+
+	if (error != NULL) {
+		len = snprintf(header, sizeof(header), "error %s\n", error);
+	} else {
+		len = snprintf(header, sizeof(header), "ok %zu\n", out.len);
+	}
+
+	/* the client may be gone, there is nobody to tell */
+	deadline = get_clock_ms() + SERVE_TIMEOUT * 1000;
+	if (send_client(fd, header, len, deadline) && error == NULL) {
+		send_client(fd, out.buf, out.len, deadline);
+	}
+
+	writer_free(&out);
+	free_node_tree(&tree);
+}
+
+/*
+ * Wait until the client is ready for events, or the deadline passes.
+ */
+static bool
+wait_client(int fd, short events, int64_t deadline)
+{
+	struct pollfd pfd;
+
+	pfd.fd = fd;
+	pfd.events = events;
+
+	for (;;) {
+		int64_t left = deadline - get_clock_ms();
+		int rc;
+
+		if (left <= 0) {
+			return false;
+		}
+
+		rc = poll(&pfd, 1, (int) left);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+
+		return rc > 0;
+	}
+}
+
+static bool
+send_client(int fd, const char *data, size_t len, int64_t deadline)
+{
+	while (len > 0) {
+		ssize_t nwritten = write(fd, data, len);
+
+		if (nwritten < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN && wait_client(fd, POLLOUT, deadline)) {
+				continue;
+			}
+			return false;
+		}
+
+		data += nwritten;
+		len -= nwritten;
+	}
+
+	return true;
+}
+
+static int64_t
+get_clock_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Make SIGINT and SIGTERM set interrupted, for --serve and --watch to stop
+ * cleanly.  Without SA_RESTART, they make a blocking poll(2) return.
+ */
+static void
+catch_interrupts(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handle_interrupt;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+}
+
+static void
+handle_interrupt(int signo)
+{
+	(void) signo;
+	interrupted = 1;
+}
+
+/*
+ * Render the node tree files dropped into a spool directory, on the job
+ * pool, until SIGINT or SIGTERM; then we wait for the running jobs.  A
+ * signal coming just before poll(2) is only noticed after its timeout,
+ * which is short enough.  The files there already are rendered
+ * first, unless their picture is newer, so a restart renders only what it
+ * missed.  Then we get the new files from inotify, once they are closed
+ * after writing or moved in.  Without inotify, or when its queue
+ * overflows, we scan the directory again.
+ */
+static bool
+watch_directory(const char *dirname)
+{
+	watcher_t watcher;
+	struct pollfd pfd;
+	bool rescan = true;
+	bool ok = true;
+	int notify_fd;
+	char events[4096] __attribute__((aligned(8)));
+
+	watcher.dirname = dirname;
+	init_job_pool(&watcher.pool, max_jobs);
+	watcher.pool.succeeded = &watcher.succeeded;
+
+	/* watch before the first scan, so we miss nothing in between */
+	notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (notify_fd >= 0 &&
+		inotify_add_watch(notify_fd, dirname,
+						  IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE |
+						  IN_MOVED_FROM | IN_ONLYDIR) < 0) {
+		write_stderr("%s: could not watch directory \"%s\": %m\n",
+					 progname, dirname);
+		close(notify_fd);
+		return false;
+	}
+
+	pfd.fd = notify_fd;
+	pfd.events = POLLIN;
+
+	catch_interrupts();
+
+	while (!interrupted) {
+		ssize_t len;
+
+		if (rescan) {
+			if (!scan_watch_directory(&watcher)) {
+				ok = false;
+				break;
+			}
+			rescan = notify_fd < 0;
+		}
+
+		reap_jobs(&watcher.pool);
+		forget_watched_files(&watcher);
+
+		/* without inotify, the fd is negative and poll(2) just sleeps */
+		if (poll(&pfd, 1, FOLLOW_POLL_INTERVAL) <= 0) {
+			continue;
+		}
+
+		while ((len = read(notify_fd, events, sizeof(events))) > 0) {
+			for (char *p = events; p < events + len;) {
+				struct inotify_event *event = (struct inotify_event *) p;
+
+				if (event->mask & IN_Q_OVERFLOW) {
+					rescan = true;
+				} else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+					watcher.started.erase(string(dirname) + "/" + event->name);
+				} else if (event->len > 0) {
+					watch_file(&watcher, event->name);
+				}
+
+				p += sizeof(struct inotify_event) + event->len;
+			}
+		}
+	}
+
+	if (notify_fd >= 0) {
+		close(notify_fd);
+	}
+	wait_jobs(&watcher.pool, 0);
+
+	return ok;
+}
+
+static bool
+scan_watch_directory(watcher_t *watcher)
+{
+	set<string> seen;
+	struct dirent *de;
+	DIR *dir;
+
+	dir = opendir(watcher->dirname);
+	if (dir == NULL) {
+		write_stderr("%s: could not open directory \"%s\": %m\n",
+					 progname, watcher->dirname);
+		return false;
+	}
+
+	while (!interrupted && (de = readdir(dir)) != NULL) {
+		watch_file(watcher, de->d_name);
+		seen.insert(string(watcher->dirname) + "/" + de->d_name);
+	}
+
+	closedir(dir);
+
+	/* the files that are gone will not come back with the same mtime */
+	for (auto it = watcher->started.begin(); it != watcher->started.end();) {
+		if (seen.find(it->first) == seen.end()) {
+			it = watcher->started.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Start a job for a file of the spool directory, unless it is not a node
+ * tree, its picture is newer, or it has not changed since its last job.
+ */
+static void
+watch_file(watcher_t *watcher, const char *name)
+{
+	string pathname = string(watcher->dirname) + "/" + name;
+	struct stat st;
+	struct stat img;
+	map<string, struct timespec>::iterator it;
+
+	if (!is_node_file(name) || stat(pathname.c_str(), &st) != 0 ||
+		!S_ISREG(st.st_mode)) {
+		return;
+	}
+
+	if (stat(get_img_filename(pathname).c_str(), &img) == 0 &&
+		(img.st_mtim.tv_sec > st.st_mtim.tv_sec ||
+		 (img.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+		  img.st_mtim.tv_nsec >= st.st_mtim.tv_nsec))) {
+		return;
+	}
+
+	it = watcher->started.find(pathname);
+	if (it != watcher->started.end() &&
+		it->second.tv_sec == st.st_mtim.tv_sec &&
+		it->second.tv_nsec == st.st_mtim.tv_nsec) {
+		return;
+	}
+	watcher->started[pathname] = st.st_mtim;
+
+	/* the job is forked, or run, before pathname goes away */
+	start_job(&watcher->pool, pathname, run_node2graph,
+			  (void *) pathname.c_str());
+}
+
+/*
+ * A file whose job succeeded has a newer picture, that is enough to skip
+ * it, so we remember only the files that failed.
+ */
+static void
+forget_watched_files(watcher_t *watcher)
+{
+	for (size_t i = 0; i < watcher->succeeded.size(); i++) {
+		watcher->started.erase(watcher->succeeded[i]);
+	}
+	watcher->succeeded.clear();
+}
+
+/*
+ * The spool directory may hold anything, the pictures too, so only the
+ * files named *.node, compressed or not, are node trees.  Hidden files are
+ * still being written by someone.
+ */
+static bool
+is_node_file(const char *name)
+{
+	static const char *const suffixes[] = {
+		".node", ".node.gz", ".node.zst", ".node.lz4"
+	};
+	size_t len = strlen(name);
+
+	if (name[0] == '.') {
+		return false;
+	}
+
+	for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+		size_t n = strlen(suffixes[i]);
+
+		if (len > n && strcmp(name + len - n, suffixes[i]) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static bool
+node2graph(const char *filename)
+{
+	const char *pathname = get_input_pathname(filename);
+	input_t input;
+	compression_t compression;
+	bool ok;
+	int fd;
+
+	/* Parse a pipe, or a compressed file, as it arrives. */
+	if (strcmp(filename, "-") == 0) {
+		compression = CompressNone;
+	} else {
+		if (!open_input(filename, &input)) {
+			return false;
+		}
+
+		compression = detect_compression(input.data, input.size);
+		if (compression == CompressNone) {
+			/* The node names refer to the input, so keep it until we are done. */
+			ok = input2graph(&input, filename, pathname);
+			close_input(&input);
+			return ok;
+		}
+
+		close_input(&input);
+	}
+
+	fd = open_input_file(filename);
+	if (fd < 0) {
+		return false;
+	}
+
+	ok = stream2graph(fd, filename, pathname);
+	close(fd);
+
+	return ok;
+}
+
+/*
+ * The pictures of the standard input ("-") are named after "stdin".
+ */
+static const char *
+get_input_pathname(const char *filename)
+{
+	return strcmp(filename, "-") == 0 ? "stdin" : filename;
+}
+
+/*
+ * Open a file for reading, "-" is the standard input.  Return a new fd in
+ * any case, so the caller closes it as usual.
+ */
+static int
+open_input_file(const char *filename)
+{
+	int fd;
+
+	if (strcmp(filename, "-") == 0) {
+		fd = dup(STDIN_FILENO);
+	} else {
+		fd = open(filename, O_RDONLY);
+	}
+
+	if (fd < 0) {
+		write_stderr("%s: could not open file \"%s\" for reading: %m\n",
+					 progname, filename);
+	}
+
+	return fd;
+}
+
+/*
+ * Convert the node tree read from fd into a picture.  The tree is parsed as
+ * it arrives, decompressed on the fly if needed, so decompression overlaps
+ * with parsing.  The parser still keeps all of the input, since the names
+ * refer to it.  This is how we read pipes and compressed files.
+ */
+static bool
+stream2graph(int fd, const char *source, const string& pathname)
+{
+	string dotfile = get_dot_filename(pathname);
+	string imgfile = get_img_filename(pathname);
+	decompressor_t dc;
+	node_parser_t parser;
+	node_tree_t tree;
+	vector<char> buf(DECOMPRESS_CHUNK_SIZE);
+	compression_t compression;
+	parse_result_t rc = ParseNeedMore;
+	ssize_t nread = 0;
+	size_t len = 0;
+	bool ok = false;
+
+	/* read enough to recognize the compression, a pipe may be slow */
+	while (len < 4) {
+		nread = read(fd, buf.data() + len, buf.size() - len);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nread <= 0) {
+			break;
+		}
+		len += nread;
+	}
+
+	if (nread < 0) {
+		write_stderr("%s: could not read file \"%s\": %m\n",
+					 progname, source);
+		return false;
+	}
+
+	compression = detect_compression(buf.data(), len);
+	if (compression != CompressNone) {
+		/* the decompressor takes what we have read */
+		if (!open_decompressor(&dc, fd, string(buf.data(), len),
+							   compression, source)) {
+			return false;
+		}
+		len = 0;
+	}
+
+	init_node_tree(&tree);
+	init_node_parser(&parser, &tree);
+
+	for (;;) {
+		if (len > 0) {
+			rc = feed_node_parser(&parser, buf.data(), len);
+			if (rc != ParseNeedMore) {
+				break;
+			}
+		}
+
+		if (compression != CompressNone) {
+			nread = read_decompressor(&dc, buf.data(), buf.size());
+		} else {
+			nread = read(fd, buf.data(), buf.size());
+			if (nread < 0 && errno == EINTR) {
+				len = 0;
+				continue;
+			}
+			if (nread < 0) {
+				write_stderr("%s: could not read file \"%s\": %m\n",
+							 progname, source);
+			}
+		}
+
+		if (nread <= 0) {
+			break;
+		}
+		len = nread;
+	}
+
+	if (compression != CompressNone) {
+		close_decompressor(&dc);
+	}
+
+	/* the error is reported already */
+	if (nread < 0) {
+		goto failed;
+	}
+
+	if (rc != ParseComplete) {
+		write_stderr("%s: could no parse node tree from \"%s\"\n",
+					 progname, source);
+		goto failed;
+	}
+
+	if (enable_merge_subtrees) {
+		merge_subtrees(&tree);
+	}
+
+	if (!render_graph(&tree, dotfile, imgfile)) {
+		goto failed;
+	}
+
+	ok = true;
+
+ failed:
+
+	free_node_tree(&tree);
+
+	return ok;
+}
+
+/*
+ * Convert the node tree in input into a picture, the dot file and picture
+ * names are derived from pathname.
+ */
+static bool
+input2graph(const input_t *input, const char *source, const string& pathname)
+{
+	string dotfile = get_dot_filename(pathname);
+	string imgfile = get_img_filename(pathname);
+	node_tree_t tree;
+	bool ok = false;
+
+	init_node_tree(&tree);
+
+	if (!parse_pg_node_tree(input, &tree)) {
+		write_stderr("%s: could no parse node tree from \"%s\"\n",
+					 progname, source);
+		goto failed;
+	}
+
+	if (enable_merge_subtrees) {
+		merge_subtrees(&tree);
+	}
+
+	if (!render_graph(&tree, dotfile, imgfile)) {
+		goto failed;
+	}
+
+	ok = true;
+
+ failed:
+
+	free_node_tree(&tree);
+
+	return ok;
+}
+
+/*
+ * Extract all node trees from a PostgreSQL server log and convert each of
+ * them into a picture, in one pass over the log.
+ *
+ * PostgreSQL prints a node tree (debug_print_parse, debug_print_rewritten
+ * and debug_print_plan) as a LOG message whose title is "parse tree:",
+ * "rewritten parse tree:" or "plan:", with the tree in the DETAIL line.
+ * The following lines of a multi-line message start with a tab.  We only
+ * keep the tree being collected in memory, so the log can be much larger
+ * than the memory.
+ */
+static bool
+log2graph(const char *filename, job_pool_t *pool)
+{
+	line_reader_t reader;
+	log_extractor_t extractor;
+	span_t line = { NULL, 0 };
+	struct stat st;
+	bool eof = false;
+
+	if (!open_line_reader(filename, &reader)) {
+		return false;
+	}
+
+	/* Huge logs on disk are scanned in parallel, unless compressed. */
+	if (max_jobs > 1 && reader.dc == NULL && fstat(reader.fd, &st) == 0 &&
+		S_ISREG(st.st_mode) && st.st_size >= LOG_CHUNK_SIZE) {
+		close_line_reader(&reader);
+		return log2graph_parallel(filename, pool);
+	}
+
+	init_log_extractor(&extractor, get_input_pathname(filename));
+
+	while (!eof) {
+		log_feed_t rc;
+
+		eof = !read_line(&reader, &line);
+
+		do {
+			rc = feed_log_extractor(&extractor, eof ? NULL : &line);
+			if (rc != LogFeedNext) {
+				start_log_tree_job(pool, &extractor.tree, extractor.ntrees);
+			}
+		} while (rc == LogFeedTreeAgain);
+	}
+
+	close_line_reader(&reader);
+
+	if (reader.failed) {
+		errno = reader.error;
+		write_stderr("%s: could not read file \"%s\": %m\n",
+					 progname, filename);
+		return false;
+	}
+
+	if (extractor.ntrees == 0) {
+		write_stderr("%s: could not find any node tree in \"%s\"\n",
+					 progname, filename);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Follow a server log like "tail -f", and render the node trees written to
+ * it from now on, each as soon as it is complete.
+ *
+ * The log extractor keeps its state between reads, so a node tree written
+ * in pieces is resumed where we stopped, and we never read a byte twice.
+ * We learn about appends from inotify, or look again every
+ * FOLLOW_POLL_INTERVAL if it is not available.  This only returns on error.
+ */
+static bool
+follow_log(const char *filename, job_pool_t *pool)
+{
+	line_reader_t reader;
+	log_extractor_t extractor;
+	span_t line = { NULL, 0 };
+	struct pollfd pfd;
+	int notify_fd;
+	char events[4096];
+
+	if (!open_line_reader(filename, &reader)) {
+		return false;
+	}
+
+	if (reader.dc != NULL) {
+		write_stderr("%s: could not follow compressed file \"%s\"\n",
+					 progname, filename);
+		close_line_reader(&reader);
+		return false;
+	}
+
+	if (lseek(reader.fd, 0, SEEK_END) < 0) {
+		write_stderr("%s: could not seek in file \"%s\": %m\n",
+					 progname, filename);
+		close_line_reader(&reader);
+		return false;
+	}
+	reader.follow = true;
+
+	notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (notify_fd >= 0 &&
+		inotify_add_watch(notify_fd, filename, IN_MODIFY) < 0) {
+		close(notify_fd);
+		notify_fd = -1;
+	}
+
+	pfd.fd = notify_fd;
+	pfd.events = POLLIN;
+
+	init_log_extractor(&extractor, get_input_pathname(filename));
+
+	for (;;) {
+		struct stat st;
+		off_t offset;
+
+		while (read_line(&reader, &line)) {
+			log_feed_t rc;
+
+			do {
+				rc = feed_log_extractor(&extractor, &line);
+				if (rc != LogFeedNext) {
+					start_log_tree_job(pool, &extractor.tree,
+									   extractor.ntrees);
+				}
+			} while (rc == LogFeedTreeAgain);
+		}
+
+		if (reader.failed) {
+			errno = reader.error;
+			write_stderr("%s: could not read file \"%s\": %m\n",
+						 progname, filename);
+			break;
+		}
+
+		/* The log was truncated, start over from its beginning. */
+		offset = lseek(reader.fd, 0, SEEK_CUR);
+		if (fstat(reader.fd, &st) == 0 && offset > st.st_size) {
+			lseek(reader.fd, 0, SEEK_SET);
+			reader.start = 0;
+			reader.end = 0;
+			extractor.in_tree = false;
+			extractor.title.clear();
+			continue;
+		}
+
+		reap_jobs(pool);
+
+		/* without inotify, the fd is negative and poll(2) just sleeps */
+		if (poll(&pfd, 1, FOLLOW_POLL_INTERVAL) > 0) {
+			while (read(notify_fd, events, sizeof(events)) > 0)
+				;
+		}
+	}
+
+	if (notify_fd >= 0) {
+		close(notify_fd);
+	}
+	close_line_reader(&reader);
+
+	return false;
+}
+
+/*
+ * Scan a server log with max_jobs threads.
+ *
+ * The log is mapped into memory and cut into chunks of LOG_CHUNK_SIZE
+ * bytes.  Each thread extracts the node trees from a chunk on its own, and
+ * then we render them in the order of the log.  We scan max_jobs chunks at
+ * a time, so we only keep the trees of those chunks in memory.
+ */
+static bool
+log2graph_parallel(const char *filename, job_pool_t *pool)
+{
+	input_t input;
+	const char *begin;
+	const char *end;
+	size_t nchunks = max_jobs;
+	size_t ntrees = 0;
+	vector<log_chunk_t> chunks(nchunks);
+
+	if (!open_input(filename, &input)) {
+		return false;
+	}
+
+	begin = input.data;
+	end = input.data + input.size;
+
+	for (const char *window = begin; window < end;) {
+		vector<thread> workers;
+
+		for (size_t i = 0; i < nchunks; i++) {
+			log_chunk_t *chunk = &chunks[i];
+			size_t left = end - window;
+
+			chunk->filename = get_input_pathname(filename);
+			chunk->begin = begin;
+			chunk->end = end;
+			chunk->start = window;
+			chunk->stop = window + min(left, (size_t) LOG_CHUNK_SIZE);
+			chunk->trees.clear();
+			window = chunk->stop;
+
+			workers.push_back(thread(scan_log_chunk, chunk));
+		}
+
+		for (size_t i = 0; i < workers.size(); i++) {
+			workers[i].join();
+		}
+
+		/* All threads are gone, so we are free to fork. */
+		for (size_t i = 0; i < nchunks; i++) {
+			vector<log_tree_t>& trees = chunks[i].trees;
+
+			for (size_t j = 0; j < trees.size(); j++) {
+				start_log_tree_job(pool, &trees[j], ++ntrees);
+			}
+			trees.clear();
+		}
+	}
+
+	close_input(&input);
+
+	if (ntrees == 0) {
+		write_stderr("%s: could not find any node tree in \"%s\"\n",
+					 progname, filename);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * Extract node trees from the log entries that start in a chunk.
+ *
+ * A chunk usually starts in the middle of a log entry, skip to the first
+ * line which does not start with a tab, that is where the next entry
+ * starts.  A node tree which starts in the chunk is followed to its end,
+ * even if that is in the next chunk.
+ */
+static void
+scan_log_chunk(log_chunk_t *chunk)
+{
+	log_extractor_t extractor;
+	const char *p = chunk->start;
+	span_t line;
+
+	init_log_extractor(&extractor, chunk->filename);
+
+	if (p != chunk->begin) {
+		/* Skip to the start of the next line, unless we are there. */
+		if (p[-1] != '\n') {
+			p = next_line(p, chunk->end, &line);
+		}
+
+		while (p < chunk->end && *p == '\t') {
+			p = next_line(p, chunk->end, &line);
+		}
+
+		/*
+		 * The previous entry belongs to the previous chunk, but it may be
+		 * the LOG line with the title of our first node tree.
+		 */
+		if (p > chunk->begin) {
+			const char *prev = p - 1;
+
+			while (prev > chunk->begin && prev[-1] != '\n') {
+				prev--;
+			}
+
+			if (*prev != '\t') {
+				next_line(prev, chunk->end, &line);
+				feed_log_extractor(&extractor, &line);
+				extractor.in_tree = false;
+			}
+		}
+	}
+
+	while (p < chunk->end) {
+		log_feed_t rc;
+
+		/* the next entry belongs to the next chunk */
+		if (p >= chunk->stop && !extractor.in_tree && *p != '\t') {
+			break;
+		}
+
+		p = next_line(p, chunk->end, &line);
+
+		do {
+			rc = feed_log_extractor(&extractor, &line);
+			if (rc != LogFeedNext) {
+				chunk->trees.push_back(extractor.tree);
+			}
+		} while (rc == LogFeedTreeAgain);
+	}
+
+	/* the log ends in the middle of a node tree */
+	if (feed_log_extractor(&extractor, NULL) != LogFeedNext) {
+		chunk->trees.push_back(extractor.tree);
+	}
+}
+
+/*
+ * Get the line starts from p, without the newline.  Return the start of the
+ * next line.
+ */
+static const char *
+next_line(const char *p, const char *end, span_t *line)
+{
+	const char *newline = (const char *) memchr(p, '\n', end - p);
+
+	line->ptr = p;
+	if (newline == NULL) {
+		line->len = end - p;
+		return end;
+	}
+
+	line->len = newline - p;
+	return newline + 1;
+}
+
+/*
+ * Render a node tree from the log, seq is its number in the log, which
+ * keeps the picture names unique.
+ */
+static void
+start_log_tree_job(job_pool_t *pool, log_tree_t *tree, size_t seq)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "_%lu", (unsigned long) seq);
+	tree->pathname += buf;
+
+	start_job(pool, tree->pathname, run_log_tree, tree);
+}
+
+static bool
+run_log_tree(void *arg)
+{
+	const log_tree_t *tree = (const log_tree_t *) arg;
+	input_t input;
+
+	input.data = tree->text.data();
+	input.size = tree->text.size();
+	input.mapped = false;
+
+	return input2graph(&input, tree->pathname.c_str(), tree->pathname);
+}
+
+static void
+init_log_extractor(log_extractor_t *ex, const char *filename)
+{
+	ex->filename = filename;
+	ex->ntrees = 0;
+	ex->in_tree = false;
+	ex->depth = 0;
+	ex->title.clear();
+	ex->tree.text.clear();
+	ex->tree.pathname.clear();
+}
+
+/*
+ * Feed a line of the log, or NULL at the end of the log.
+ *
+ * A node tree ends when its top-level braces are balanced, with the same
+ * rules as parse_pg_node_tree(), or at the end of the message, whichever
+ * comes first.  When a node tree is complete, it is in ex->tree until the
+ * next call.
+ */
+static log_feed_t
+feed_log_extractor(log_extractor_t *ex, const span_t *line)
+{
+	const char *log;
+	const char *detail;
+	const char *msg;
+	const char *end;
+
+	if (ex->in_tree) {
+		/* the following lines of a message start with a tab */
+		if (line != NULL && line->len > 0 && line->ptr[0] == '\t') {
+			return append_log_tree_line(ex, line->ptr + 1, line->len - 1);
+		}
+
+		ex->in_tree = false;
+		ex->ntrees++;
+		return LogFeedTreeAgain;
+	}
+
+	if (line == NULL) {
+		return LogFeedNext;
+	}
+
+	end = line->ptr + line->len;
+
+	/*
+	 * The message may contain these words too, the one that comes first is
+	 * the severity.
+	 */
+	log = (const char *) memmem(line->ptr, line->len, "LOG:", 4);
+	detail = (const char *) memmem(line->ptr, line->len, "DETAIL:", 7);
+
+	/* The title of the node tree is in the LOG message before it. */
+	if (log != NULL && (detail == NULL || log < detail)) {
+		msg = log + 4;
+		while (msg < end && isspace(*msg)) {
+			msg++;
+		}
+		ex->title.assign(msg, end - msg);
+		return LogFeedNext;
+	}
+
+	if (detail == NULL) {
+		ex->title.clear();
+		return LogFeedNext;
+	}
+
+	msg = detail + 7;
+	while (msg < end && isspace(*msg)) {
+		msg++;
+	}
+
+	if (msg == end || *msg != '{') {
+		ex->title.clear();
+		return LogFeedNext;
+	}
+
+	ex->in_tree = true;
+	ex->depth = 0;
+	ex->tree.text.clear();
+	ex->tree.pathname = get_log_tree_pathname(ex, line->ptr, detail);
+	ex->title.clear();
+
+	/* without debug_pretty_print, the whole tree is in this line */
+	return append_log_tree_line(ex, msg, end - msg);
+}
+
+/*
+ * Append a line of the node tree, and check whether the tree is complete.
+ */
+static log_feed_t
+append_log_tree_line(log_extractor_t *ex, const char *line, size_t len)
+{
+	scanner_t sc;
+	const char *token;
+
+	scanner_init(&sc, line, line + len);
+	while ((token = scanner_next(&sc)) != NULL) {
+		if (*token == '{') {
+			ex->depth++;
+		} else if (*token == '}' && --ex->depth == 0) {
+			/* ignore anything after the tree */
+			ex->tree.text.append(line, token + 1 - line);
+			ex->tree.text.push_back('\n');
+			ex->in_tree = false;
+			ex->ntrees++;
+			return LogFeedTree;
+		}
+	}
+
+	ex->tree.text.append(line, len);
+	ex->tree.text.push_back('\n');
+
+	return LogFeedNext;
+}
+
+/*
+ * Name the picture of a node tree from the log after the time and the pid
+ * in the log line prefix, and the kind of the tree, for example:
+ *
+ *   postgresql.log.2022-08-28_07-37-51.841_22278_plan_1
+ *
+ * The sequence number at the end, which keeps the names unique, is added
+ * by start_log_tree_job().  Parts that are not in the prefix are left out.
+ */
+static string
+get_log_tree_pathname(const log_extractor_t *ex, const char *prefix,
+					  const char *prefix_end)
+{
+	string pathname(ex->filename);
+	const char *p;
+
+	pathname += ".";
+
+	/* a timestamp looks like "2022-08-28 07:37:51.841" */
+	for (p = prefix; p + 19 <= prefix_end; p++) {
+		if (isdigit(p[0]) && isdigit(p[1]) && isdigit(p[2]) && isdigit(p[3]) &&
+			p[4] == '-' && p[7] == '-' && (p[10] == ' ' || p[10] == 'T') &&
+			p[13] == ':' && p[16] == ':') {
+			const char *q = p + 19;
+
+			if (q < prefix_end && *q == '.') {
+				q++;
+				while (q < prefix_end && isdigit(*q)) {
+					q++;
+				}
+			}
+
+			/* no spaces or colons in file names */
+			for (; p < q; p++) {
+				if (*p == ' ') {
+					pathname += '_';
+				} else if (*p == ':') {
+					pathname += '-';
+				} else {
+					pathname += *p;
+				}
+			}
+			pathname += "_";
+			break;
+		}
+	}
+
+	/* the pid looks like "[22278]" */
+	for (p = prefix; p < prefix_end; p++) {
+		if (*p == '[' && p + 1 < prefix_end && isdigit(p[1])) {
+			const char *q = p + 1;
+
+			while (q < prefix_end && isdigit(*q)) {
+				q++;
+			}
+
+			if (q < prefix_end && *q == ']') {
+				pathname.append(p + 1, q - p - 1);
+				pathname += "_";
+				break;
+			}
+		}
+	}
+
+	if (ex->title == "parse tree:") {
+		pathname += "parse";
+	} else if (ex->title == "rewritten parse tree:") {
+		pathname += "rewritten";
+	} else if (ex->title == "plan:") {
+		pathname += "plan";
+	} else {
+		pathname += "tree";
+	}
+
+	return pathname;
+}
+
+static bool
+open_line_reader(const char *filename, line_reader_t *reader)
+{
+	compression_t compression;
+
+	reader->fd = open_input_file(filename);
+	if (reader->fd < 0) {
+		return false;
+	}
+
+	reader->dc = NULL;
+	compression = get_file_compression(reader->fd);
+	if (compression != CompressNone) {
+		reader->dc = new decompressor_t;
+		if (!open_decompressor(reader->dc, reader->fd, string(),
+							   compression, filename)) {
+			delete reader->dc;
+			close(reader->fd);
+			return false;
+		}
+	}
+
+	reader->buf = (char *) malloc(LINE_READER_BUFFER_SIZE);
+	if (reader->buf == NULL) {
+		write_stderr("%s: out of memory\n", progname);
+		exit(1);
+	}
+
+	reader->size = LINE_READER_BUFFER_SIZE;
+	reader->start = 0;
+	reader->end = 0;
+	reader->eof = false;
+	reader->follow = false;
+	reader->failed = false;
+	reader->error = 0;
+
+	return true;
+}
+
+static void
+close_line_reader(line_reader_t *reader)
+{
+	if (reader->dc != NULL) {
+		close_decompressor(reader->dc);
+		delete reader->dc;
+		reader->dc = NULL;
+	}
+	close(reader->fd);
+	free(reader->buf);
+	reader->fd = -1;
+	reader->buf = NULL;
+}
+
+/*
+ * Read the next line without the newline.  The line is valid until the
+ * next call.  Return false at the end of the file or on error.
+ *
+ * When following the file, a partial line at the end is kept until the
+ * rest of it is written, and the end of the file is not final.
+ */
+static bool
+read_line(line_reader_t *reader, span_t *line)
+{
+	for (;;) {
+		char *start = reader->buf + reader->start;
+		char *newline = (char *) memchr(start, '\n',
+										reader->end - reader->start);
+		ssize_t nread;
+
+		if (newline != NULL) {
+			line->ptr = start;
+			line->len = newline - start;
+			reader->start += line->len + 1;
+			return true;
+		}
+
+		if (reader->eof) {
+			/* the last line may have no newline */
+			if (reader->start < reader->end) {
+				line->ptr = start;
+				line->len = reader->end - reader->start;
+				reader->start = reader->end;
+				return true;
+			}
+			return false;
+		}
+
+		/* Make room for more data, keep the partial line. */
+		if (reader->start > 0) {
+			memmove(reader->buf, start, reader->end - reader->start);
+			reader->end -= reader->start;
+			reader->start = 0;
+		}
+
+		if (reader->end == reader->size) {
+			char *buf = (char *) realloc(reader->buf, reader->size * 2);
+
+			if (buf == NULL) {
+				write_stderr("%s: out of memory\n", progname);
+				exit(1);
+			}
+			reader->buf = buf;
+			reader->size *= 2;
+		}
+
+		if (reader->dc != NULL) {
+			nread = read_decompressor(reader->dc, reader->buf + reader->end,
+									  reader->size - reader->end);
+		} else {
+			nread = read(reader->fd, reader->buf + reader->end,
+						 reader->size - reader->end);
+		}
+		if (nread < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			reader->failed = true;
+			reader->error = errno;
+			reader->eof = true;
+		} else if (nread == 0) {
+			if (reader->follow) {
+				return false;
+			}
+			reader->eof = true;
+		} else {
+			reader->end += nread;
+		}
+	}
+}
+
+static bool
+render_graph(const node_tree_t *tree, const string& dotfile,
+			 const string& imgfile)
+{
+	if (stdout_mode == StdoutDot) {
+		return write_dot_stdout(tree);
+	}
+
+	if (cache_directory != NULL) {
+		return render_graph_cached(tree, dotfile, imgfile);
+	}
+
+	return render_picture(tree, dotfile, imgfile);
+}
+
+/*
+ * Render the picture of a tree, whichever way the options ask for.
+ */
+static bool
+render_picture(const node_tree_t *tree, const string& dotfile,
+			   const string& imgfile)
+{
+	if (enable_native_layout) {
+		return render_graph_native(tree, imgfile);
+	}
+
+	if (page_size > 0) {
+		return render_graph_pages(tree, dotfile, imgfile);
+	}
+
+	return render_graph_dot(tree, NULL, 0, dotfile, imgfile);
+}
+
+/*
+ * Render a tree through the cache in --cache-dir.  The pictures are named
+ * after the hash of the tree and of the options they depend on, so the
+ * same plan logged again and again is rendered once, and then copied from
+ * the cache, without writing a dot script or running Graphviz.
+ *
+ * The pictures are copied rather than linked: a later run without the
+ * cache writes the picture in place, which would change the cached one
+ * through a hard link.
+ */
+static bool
+render_graph_cached(const node_tree_t *tree, const string& dotfile,
+					const string& imgfile)
+{
+	string key = get_cache_key(tree);
+	string entry = string(cache_directory) + "/" + key + "." + picture_format;
+	string tmpfile;
+	bool ok;
+	int fd;
+
+	/* an open file survives the eviction by another job */
+	fd = open(entry.c_str(), O_RDONLY);
+	if (fd >= 0) {
+		ok = copy_file(fd, imgfile);
+		close(fd);
+		if (ok) {
+			/* the mtime orders the entries for the eviction */
+			utimensat(AT_FDCWD, entry.c_str(), NULL, 0);
+		}
+		return ok;
+	}
+
+	if (!render_picture(tree, dotfile, imgfile)) {
+		return false;
+	}
+
+	/*
+	 * Add the picture under a temporary name, so other jobs never see it
+	 * half written.  The picture is there anyway, so a cache we cannot
+	 * write to is not an error.
+	 */
+	fd = open(imgfile.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return true;
+	}
+
+	tmpfile = string(cache_directory) + "/." + key + "." +
+		to_string((long) getpid());
+	if (copy_file(fd, tmpfile) && rename(tmpfile.c_str(), entry.c_str()) == 0) {
+		evict_cache();
+	} else {
+		unlink(tmpfile.c_str());
+	}
+	close(fd);
+
+	return true;
+}
+
+/*
+ * Everything but the tree that changes the picture goes into the key of
+ * the cache.  Bump the version when the output changes.
+ */
+static void
+init_cache_options(void)
+{
+	cache_options = string(VERSION) + "\n" + picture_format + "\n";
+	cache_options += enable_native_layout ? "native\n" : "dot\n";
+	cache_options += enable_merge_subtrees ? "merge\n" : "\n";
+	cache_options += enable_skip_empty ? "skip-empty\n" : "\n";
+	cache_options += to_string(max_depth) + " " + to_string(max_children) + "\n";
+
+	for (const string& type : include_types) {
+		cache_options += "include " + type + "\n";
+	}
+	for (const string& type : exclude_types) {
+		cache_options += "exclude " + type + "\n";
+	}
+	for (const string& field : exclude_fields) {
+		cache_options += "exclude " + field + "\n";
+	}
+	for (const string& field : normalize_fields) {
+		cache_options += "normalize " + field + "\n";
+	}
+
+	if (enable_color) {
+		for (const auto& it : node_color_mapping) {
+			cache_options += "color " + it.first + "," + it.second.bgcolor +
+				"," + it.second.fontcolor + "\n";
+		}
+	}
+}
+
+/*
+ * Hash the tree as we got it from the parser, with the filters and limits
+ * applied: the tag, the parent and the name of each node.  The preorder
+ * numbering makes the parents enough for the shape.
+ */
+static string
+get_cache_key(const node_tree_t *tree)
+{
+	hasher_t h;
+	char key[17];
+
+	hasher_init(&h);
+	hasher_update(&h, cache_options.data(), cache_options.size());
+
+	for (uint32_t node = 0; node < tree->tag.size(); node++) {
+		span_t name = get_node_name(tree, node);
+		uint32_t len = name.len;
+
+		hasher_update(&h, &tree->tag[node], sizeof(tree->tag[node]));
+		hasher_update(&h, &tree->parent[node], sizeof(tree->parent[node]));
+		hasher_update(&h, &len, sizeof(len));
+		hasher_update(&h, name.ptr, name.len);
+	}
+
+	snprintf(key, sizeof(key), "%016llx",
+			 (unsigned long long) hasher_final(&h));
+
+	return key;
+}
+
+/*
+ * Copy from fd into the file dst, which is replaced.
+ */
+static bool
+copy_file(int fd, const string& dst)
+{
+	vector<char> buf(WRITER_BUFFER_SIZE);
+	ssize_t nread;
+	bool ok = true;
+	int out;
+
+	out = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out < 0) {
+		write_stderr("%s: could not open file \"%s\" for writing: %m\n",
+					 progname, dst.c_str());
+		return false;
+	}
+
+	for (;;) {
+		nread = read(fd, buf.data(), buf.size());
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nread < 0) {
+			write_stderr("%s: could not read the cache for \"%s\": %m\n",
+						 progname, dst.c_str());
+			ok = false;
+			break;
+		}
+		if (nread == 0) {
+			break;
+		}
+		if (!write_all(out, buf.data(), nread)) {
+			write_stderr("%s: could not write file \"%s\": %m\n",
+						 progname, dst.c_str());
+			ok = false;
+			break;
+		}
+	}
+
+	if (close(out) != 0 && ok) {
+		write_stderr("%s: could not write file \"%s\": %m\n",
+					 progname, dst.c_str());
+		ok = false;
+	}
+
+	return ok;
+}
+
+/*
+ * Remove the least recently used pictures until the cache fits in
+ * --cache-size.  A hit touches the mtime of its picture, so the oldest
+ * mtime goes first.  Jobs running in parallel may race to remove the same
+ * picture, which is harmless.
+ */
+static void
+evict_cache(void)
+{
+	vector<cache_entry_t> entries;
+	uint64_t total = 0;
+	struct dirent *de;
+	struct stat st;
+	DIR *dir;
+
+	dir = opendir(cache_directory);
+	if (dir == NULL) {
+		return;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		cache_entry_t entry;
+
+		/* skip ".", ".." and the pictures being added */
+		if (de->d_name[0] == '.') {
+			continue;
+		}
+
+		entry.name = string(cache_directory) + "/" + de->d_name;
+		if (stat(entry.name.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+			continue;
+		}
+
+		entry.mtime = st.st_mtime;
+		entry.size = st.st_size;
+		total += st.st_size;
+		entries.push_back(entry);
+	}
+
+	closedir(dir);
+
+	if (total <= cache_size) {
+		return;
+	}
+
+	sort(entries.begin(), entries.end(),
+		 [](const cache_entry_t& a, const cache_entry_t& b) {
+			 return a.mtime < b.mtime;
+		 });
+
+	for (const cache_entry_t& entry : entries) {
+		if (total <= cache_size) {
+			break;
+		}
+		if (unlink(entry.name.c_str()) == 0 || errno == ENOENT) {
+			total -= entry.size;
+		}
+	}
+}
+
+/*
+ * Render a tree into memory for --serve, in format, or as the dot script
+ * with "dot".  With --native, only SVG is rendered.
+ */
+static bool
+render_graph_data(const node_tree_t *tree, const string& format,
+				  writer_t *out)
+{
+	if (format == "dot") {
+		write_dot_script(tree, NULL, 0, out);
+		return true;
+	}
+
+	if (enable_native_layout) {
+		native_layout_t layout;
+
+		if (format != "svg") {
+			write_stderr("%s: --native only supports the svg format\n",
+						 progname);
+			return false;
+		}
+
+		layout_native_graph(tree, &layout);
+		write_native_svg(tree, &layout, out);
+		return true;
+	}
+
+#ifdef HAVE_LIBGVC
+	return render_data_libgvc(tree, format, out);
+#else
+	return render_data_program(tree, format, out);
+#endif
+}
+
+/*
+ * Render the whole graph, or a page of it, with Graphviz.
+ */
+static bool
+render_graph_dot(const node_tree_t *tree, const graph_pages_t *pages,
+				 uint32_t page, const string& dotfile, const string& imgfile)
+{
+#ifdef HAVE_LIBGVC
+	return render_graph_libgvc(tree, pages, page, dotfile, imgfile);
+#else
+	return render_graph_program(tree, pages, page, dotfile, imgfile);
+#endif
+}
+
+/*
+ * Cut a graph bigger than --page-size into pages, and render them in
+ * parallel, unless we are a job already.  The first page keeps the names
+ * of the whole graph, the others are numbered from 2, and an HTML index
+ * lists them all.
+ */
+static bool
+render_graph_pages(const node_tree_t *tree, const string& dotfile,
+				   const string& imgfile)
+{
+	string img_suffix = string(".") + picture_format;
+	graph_pages_t pages;
+	vector<page_job_t> jobs;
+	job_pool_t pool;
+	uint32_t npages;
+
+	split_graph(tree, &pages);
+
+	npages = pages.roots.size();
+	if (npages == 1) {
+		return render_graph_dot(tree, NULL, 0, dotfile, imgfile);
+	}
+
+	for (uint32_t page = 0; page < npages; page++) {
+		pages.dotfiles.push_back(get_page_filename(dotfile, ".dot", page));
+		pages.imgfiles.push_back(get_page_filename(imgfile, img_suffix, page));
+	}
+
+	jobs.resize(npages);
+	init_job_pool(&pool, may_fork ? max_jobs : 1);
+	pool.quiet = true;
+
+	for (uint32_t page = 0; page < npages; page++) {
+		jobs[page].tree = tree;
+		jobs[page].pages = &pages;
+		jobs[page].page = page;
+		start_job(&pool, pages.imgfiles[page], run_page_job, &jobs[page]);
+	}
+
+	wait_jobs(&pool, 0);
+
+	if (!write_page_index(tree, &pages,
+						  imgfile.substr(0, imgfile.size() -
+										 img_suffix.size()) + ".html")) {
+		return false;
+	}
+
+	return pool.nfailed == 0;
+}
+
+static bool
+run_page_job(void *arg)
+{
+	const page_job_t *job = (const page_job_t *) arg;
+
+	return render_graph_dot(job->tree, job->pages, job->page,
+							job->pages->dotfiles[job->page],
+							job->pages->imgfiles[job->page]);
+}
+
+/*
+ * Cut the tree of dot nodes into subtrees of at most --page-size dot
+ * nodes.  From the leaves up, once the subtrees below a dot node add up to
+ * more than that, the biggest of them are cut off as pages of their own.
+ */
+static void
+split_graph(const node_tree_t *tree, graph_pages_t *pages)
+{
+	uint32_t nnodes = tree->tag.size();
+	vector<uint32_t> parent(nnodes, InvalidNode);
+	vector<uint32_t> first_child(nnodes, InvalidNode);
+	vector<uint32_t> next_sibling(nnodes, InvalidNode);
+	vector<uint32_t> size(nnodes, 0);
+	vector<bool> cut(nnodes, false);
+	vector<uint32_t> nodes;
+	vector<pair<uint32_t, uint32_t>> children;
+
+	/* The dot nodes and the edges between them, as write_dot_script(). */
+	for (uint32_t node = 0; node < nnodes; node++) {
+		bool list = tree->tag[node] == TagList;
+		uint32_t prev = InvalidNode;
+
+		if (is_merged_node(tree, node)) {
+			node = get_subtree_end(tree, node) - 1;
+			continue;
+		}
+
+		if (tree->tag[node] == TagNode) {
+			nodes.push_back(node);
+		}
+
+		for (uint32_t child = tree->first_child[node];
+			 child != InvalidNode;
+			 prev = child, child = tree->next_sibling[child]) {
+			uint32_t src;
+
+			if (tree->tag[child] != TagNode || is_merged_node(tree, child)) {
+				continue;
+			}
+
+			src = (list && hangs_from_prev(tree, prev)) ?
+				tree->suffix[prev] : tree->suffix[node];
+			parent[child] = src;
+			next_sibling[child] = first_child[src];
+			first_child[src] = child;
+		}
+	}
+
+	/* The children come after their parents, so go backwards. */
+	for (size_t i = nodes.size(); i-- > 0;) {
+		uint32_t node = nodes[i];
+
+		size[node]++;
+
+		if (size[node] > page_size) {
+			children.clear();
+			for (uint32_t child = first_child[node];
+				 child != InvalidNode;
+				 child = next_sibling[child]) {
+				children.push_back(make_pair(size[child], child));
+			}
+			sort(children.rbegin(), children.rend());
+
+			for (size_t j = 0;
+				 j < children.size() && size[node] > page_size; j++) {
+				cut[children[j].second] = true;
+				size[node] -= children[j].first;
+			}
+		}
+
+		if (parent[node] != InvalidNode) {
+			size[parent[node]] += size[node];
+		}
+	}
+
+	pages->page.assign(nnodes, 0);
+	pages->roots.assign(1, 0);
+	pages->from.assign(1, 0);
+	for (size_t i = 1; i < nodes.size(); i++) {
+		uint32_t node = nodes[i];
+
+		if (cut[node]) {
+			pages->page[node] = pages->roots.size();
+			pages->roots.push_back(node);
+			pages->from.push_back(pages->page[parent[node]]);
+		} else {
+			pages->page[node] = pages->page[parent[node]];
+		}
+	}
+}
+
+/*
+ * The file of a page, the page number goes before the suffix.
+ */
+static string
+get_page_filename(const string& filename, const string& suffix,
+				  uint32_t page)
+{
+	if (page == 0) {
+		return filename;
+	}
+
+	return filename.substr(0, filename.size() - suffix.size()) + "." +
+		to_string(page + 1) + suffix;
+}
+
+/*
+ * Write the index of the pages, with the type of the node each of them
+ * starts from, and the page it comes from.
+ */
+static bool
+write_page_index(const node_tree_t *tree, const graph_pages_t *pages,
+				 const string& indexfile)
+{
+	size_t start = indexfile.find_last_of('/') + 1;
+	writer_t writer;
+	int fd;
+	bool ok;
+
+	fd = open(indexfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0) {
+		write_stderr("%s: could not open file \"%s\" for writing: %m\n",
+					 progname, indexfile.c_str());
+		return false;
+	}
+
+	writer_init(&writer, fd);
+	put_literal(&writer,
+				"<!DOCTYPE html>\n"
+				"<html>\n"
+				"<head><meta charset=\"utf-8\"><title>");
+	put_svg_text(&writer, indexfile.data() + start,
+				 indexfile.size() - start - strlen(".html"));
+	put_literal(&writer,
+				"</title></head>\n"
+				"<body>\n"
+				"<ol>\n");
+
+	for (uint32_t page = 0; page < pages->roots.size(); page++) {
+		const string& imgfile = pages->imgfiles[page];
+		size_t start = imgfile.find_last_of('/') + 1;
+		uint32_t root = pages->roots[page];
+		span_t name = get_node_name(tree, root);
+		span_t type = get_node_type(name.ptr, name.ptr + name.len);
+
+		put_literal(&writer, "<li><a href=\"");
+		put_svg_text(&writer, imgfile.data() + start, imgfile.size() - start);
+		put_literal(&writer, "\">page ");
+		put_uint(&writer, page + 1);
+		put_literal(&writer, "</a> ");
+		put_svg_text(&writer, type.ptr, type.len);
+		if (page > 0) {
+			put_literal(&writer, ", from page ");
+			put_uint(&writer, pages->from[page] + 1);
+		}
+		put_literal(&writer, "</li>\n");
+	}
+
+	put_literal(&writer,
+				"</ol>\n"
+				"</body>\n"
+				"</html>\n");
+
+	ok = writer_flush(&writer);
+	if (!ok) {
+		errno = writer.error;
+		write_stderr("%s: could not write file \"%s\": %m\n",
+					 progname, indexfile.c_str());
+	}
+
+	if (close(fd) != 0 && ok) {
+		write_stderr("%s: could not close file \"%s\": %m\n",
+					 progname, indexfile.c_str());
+		ok = false;
+	}
+
+	writer_free(&writer);
+
+	return ok;
+}
+
+/*
+ * Write the dot script to stdout, for the user to render it.
+ */
+static bool
+write_dot_stdout(const node_tree_t *tree)
+{
+	writer_t writer;
+	bool ok;
+
+	writer_init(&writer, STDOUT_FILENO);
+	write_dot_script(tree, NULL, 0, &writer);
+
+	ok = writer_flush(&writer);
+	if (!ok) {
+		errno = writer.error;
+		write_stderr("%s: could not write dot script to stdout: %m\n",
+					 progname);
+	}
+
+	writer_free(&writer);
+
+	return ok;
+}
+
+#ifdef HAVE_LIBGVC
+/*
+ * Lay out and render the graph with libgvc in this process, from a dot
+ * script in memory.  The dot file is only written if the user wants to
+ * keep it.
+ */
+static bool
+render_graph_libgvc(const node_tree_t *tree, const graph_pages_t *pages,
+					uint32_t page, const string& dotfile,
+					const string& imgfile)
+{
+	writer_t writer;
+	Agraph_t *graph = NULL;
+	bool ok = false;
+	int rc;
+
+	writer_init(&writer, -1);
+	write_dot_script(tree, pages, page, &writer);
+	put_bytes(&writer, "", 1);		/* agmemread() wants a C string */
+
+	if (!remove_dot_files) {
+		int fd = open(dotfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+		if (fd < 0) {
+			write_stderr("%s: could not open file \"%s\" for writing: %m\n",
+						 progname, dotfile.c_str());
+			goto failed;
+		}
+
+		if (!write_all(fd, writer.buf, writer.len - 1)) {
+			write_stderr("%s: could not write file \"%s\": %m\n",
+						 progname, dotfile.c_str());
+			close(fd);
+			goto failed;
+		}
+
+		if (close(fd) != 0) {
+			write_stderr("%s: could not close file \"%s\": %m\n",
+						 progname, dotfile.c_str());
+			goto failed;
+		}
+	}
+
+	graph = agmemread(writer.buf);
+	if (graph == NULL) {
+		write_stderr("%s: could not parse dot script for \"%s\"\n",
+					 progname, imgfile.c_str());
+		goto failed;
+	}
+
+	if (gvLayout(gvc_context, graph, "dot") != 0) {
+		write_stderr("%s: could not layout graph for \"%s\"\n",
+					 progname, imgfile.c_str());
+		goto failed;
+	}
+
+	if (imgfile == "-") {
+		rc = gvRender(gvc_context, graph, picture_format, stdout);
+		fflush(stdout);
+	} else {
+		rc = gvRenderFilename(gvc_context, graph, picture_format,
+							  imgfile.c_str());
+	}
+
+	if (rc != 0) {
+		write_stderr("%s: could not render graph into \"%s\"\n",
+					 progname, imgfile.c_str());
+		gvFreeLayout(gvc_context, graph);
+		goto failed;
+	}
+
+	gvFreeLayout(gvc_context, graph);
+	ok = true;
+
+ failed:
+
+	if (graph != NULL) {
+		agclose(graph);
+	}
+	writer_free(&writer);
+
+	return ok;
+}
+
+/*
+ * Render with libgvc into out.  The threads of --serve share the Graphviz
+ * context, and neither it nor cgraph is thread safe, so they take turns.
+ */
+static bool
+render_data_libgvc(const node_tree_t *tree, const string& format,
+				   writer_t *out)
+{
+	writer_t writer;
+	Agraph_t *graph;
+	char *data = NULL;
+	size_t len = 0;
+	FILE *stream;
+	bool ok = false;
+
+	writer_init(&writer, -1);
+	write_dot_script(tree, NULL, 0, &writer);
+	put_bytes(&writer, "", 1);		/* agmemread() wants a C string */
+
+	stream = open_memstream(&data, &len);
+	if (stream == NULL) {
+		write_stderr("%s: out of memory\n", progname);
+		writer_free(&writer);
+		return false;
+	}
+
+	{
+		lock_guard<mutex> guard(gvc_lock);
+
+		graph = agmemread(writer.buf);
+		if (graph == NULL) {
+			write_stderr("%s: could not parse dot script for \"%s\"\n",
+						 progname, serve_socket);
+		} else if (gvLayout(gvc_context, graph, "dot") != 0) {
+			write_stderr("%s: could not layout graph for \"%s\"\n",
+						 progname, serve_socket);
+		} else {
+			ok = gvRender(gvc_context, graph, format.c_str(), stream) == 0;
+			if (!ok) {
+				write_stderr("%s: could not render graph in format \"%s\"\n",
+							 progname, format.c_str());
+			}
+			gvFreeLayout(gvc_context, graph);
+		}
+
+		if (graph != NULL) {
+			agclose(graph);
+		}
+	}
+
+	if (fclose(stream) != 0) {
+		ok = false;
+	}
+	if (ok) {
+		put_bytes(out, data, len);
+	}
+
+	free(data);
+	writer_free(&writer);
+
+	return ok;
+}
+#else
+/*
+ * Run the dot program to convert the dot script into a picture.
+ *
+ * If the user does not keep the dot files, the script is streamed to dot
+ * through a pipe and never touches the filesystem.  Otherwise, write the
+ * dot file first and let dot read it.
+ */
+static bool
+render_graph_program(const node_tree_t *tree, const graph_pages_t *pages,
+					 uint32_t page, const string& dotfile,
+					 const string& imgfile)
+{
+	int dotfd;
+	writer_t writer;
+	pid_t pid;
+	bool ok = false;
+	const char *argv[7] = { "dot", "-T", picture_format };
+	int argc = 3;
+
+	/* without -o, dot writes to our stdout */
+	if (imgfile != "-") {
+		argv[argc++] = "-o";
+		argv[argc++] = imgfile.c_str();
+	}
+	if (!remove_dot_files) {
+		argv[argc++] = dotfile.c_str();
+	}
+	argv[argc] = NULL;
+
+	if (remove_dot_files) {
+		pid = spawn_dot_program(argv, &dotfd, NULL);
+		if (pid < 0) {
+			return false;
+		}
+	} else {
+		dotfd = open(dotfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (dotfd < 0) {
+			write_stderr("%s: could not open file \"%s\" for writing: %m\n",
+						 progname, dotfile.c_str());
+			return false;
+		}
+		pid = -1;
+	}
+
+	writer_init(&writer, dotfd);
+	write_dot_script(tree, pages, page, &writer);
+	if (!writer_flush(&writer)) {
+		errno = writer.error;
+		write_stderr("%s: could not write dot script for \"%s\": %m\n",
+					 progname, imgfile.c_str());
+	}
+
+	if (close(dotfd) != 0 && !writer.failed) {
+		write_stderr("%s: could not close dot script for \"%s\": %m\n",
+					 progname, imgfile.c_str());
+		writer.failed = true;
+	}
+
+	/* With a file, we can start dot only after the script is complete. */
+	if (!writer.failed && pid < 0) {
+		pid = spawn_dot_program(argv, NULL, NULL);
+	}
+
+	if (pid >= 0) {
+		/* Always reap the child, even if we failed to feed it. */
+		ok = wait_dot_program(pid, imgfile) && !writer.failed;
+	}
+
+	writer_free(&writer);
+
+	return ok;
+}
+
+/*
+ * Render with the dot program into out: the script goes to its standard
+ * input, the picture comes from its standard output.  dot reads the whole
+ * graph before it writes anything, so we can do one after the other.
+ */
+static bool
+render_data_program(const node_tree_t *tree, const string& format,
+					writer_t *out)
+{
+	const char *argv[] = { "dot", "-T", format.c_str(), NULL };
+	writer_t writer;
+	int dotfd;
+	int imgfd;
+	pid_t pid;
+	bool ok;
+
+	pid = spawn_dot_program(argv, &dotfd, &imgfd);
+	if (pid < 0) {
+		return false;
+	}
+
+	writer_init(&writer, dotfd);
+	write_dot_script(tree, NULL, 0, &writer);
+	ok = writer_flush(&writer);
+	close(dotfd);
+
+	for (;;) {
+		char *p = writer_reserve(out, WRITER_BUFFER_SIZE);
+		ssize_t nread = read(imgfd, p, WRITER_BUFFER_SIZE);
+
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+		if (nread < 0) {
+			write_stderr("%s: could not read from \"dot\": %m\n", progname);
+			ok = false;
+			break;
+		}
+		if (nread == 0) {
+			break;
+		}
+		out->len += nread;
+	}
+	close(imgfd);
+
+	/* Always reap the child, even if we failed to feed it. */
+	ok = wait_dot_program(pid, serve_socket) && ok;
+
+	writer_free(&writer);
+
+	return ok;
+}
+
+/*
+ * Start the dot program with posix_spawn(), without a shell in between.
+ * If stdin_fd is not NULL, connect the stdin of dot to a pipe, and return
+ * its write end in *stdin_fd.  Return the pid of dot, or -1 on error.
+ */
+static pid_t
+spawn_dot_program(const char *const argv[], int *stdin_fd, int *stdout_fd)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t sigdefault;
+	sigset_t sigmask;
+	int fds[2] = { -1, -1 };
+	int outfds[2] = { -1, -1 };
+	pid_t pid;
+	int rc;
+
+	/* the pipes are close-on-exec, so other dot programs do not keep them */
+	if (stdin_fd != NULL && pipe2(fds, O_CLOEXEC) != 0) {
+		write_stderr("%s: could not create pipe: %m\n", progname);
+		return -1;
+	}
+
+	if (stdout_fd != NULL && pipe2(outfds, O_CLOEXEC) != 0) {
+		write_stderr("%s: could not create pipe: %m\n", progname);
+		if (stdin_fd != NULL) {
+			close(fds[0]);
+			close(fds[1]);
+		}
+		return -1;
+	}
+
+	posix_spawn_file_actions_init(&actions);
+	if (stdin_fd != NULL) {
+		posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+	}
+	if (stdout_fd != NULL) {
+		posix_spawn_file_actions_adddup2(&actions, outfds[1], STDOUT_FILENO);
+	}
+
+	/*
+	 * We ignore SIGPIPE, but dot should not.  The threads of --serve block
+	 * SIGINT and SIGTERM, dot should not either.
+	 */
+	posix_spawnattr_init(&attr);
+	sigemptyset(&sigdefault);
+	sigaddset(&sigdefault, SIGPIPE);
+	sigemptyset(&sigmask);
+	posix_spawnattr_setsigdefault(&attr, &sigdefault);
+	posix_spawnattr_setsigmask(&attr, &sigmask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF |
+							 POSIX_SPAWN_SETSIGMASK);
+
+	rc = posix_spawnp(&pid, argv[0], &actions, &attr,
+					  (char *const *) argv, environ);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (stdin_fd != NULL) {
+		close(fds[0]);
+	}
+	if (stdout_fd != NULL) {
+		close(outfds[1]);
+	}
+
+	if (rc != 0) {
+		errno = rc;
+		write_stderr("%s: could not execute \"%s\": %m\n", progname, argv[0]);
+		if (stdin_fd != NULL) {
+			close(fds[1]);
+		}
+		if (stdout_fd != NULL) {
+			close(outfds[0]);
+		}
+		return -1;
+	}
+
+	if (stdin_fd != NULL) {
+		*stdin_fd = fds[1];
+	}
+	if (stdout_fd != NULL) {
+		*stdout_fd = outfds[0];
+	}
+
+	return pid;
+}
+
+static bool
+wait_dot_program(pid_t pid, const string& imgfile)
+{
+	int status;
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			write_stderr("%s: could not wait for \"dot\": %m\n", progname);
+			return false;
+		}
+	}
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		write_stderr("%s: \"dot\" could not convert \"%s\"\n",
+					 progname, imgfile.c_str());
+		return false;
+	}
+
+	return true;
+}
+#endif
+
+/*
+ * Lay out the graph ourselves and write it as SVG, without Graphviz.
+ *
+ * Each dot node is a box of rows, and every box but the root has exactly
+ * one incoming edge, so the graph is a tree, and a tidy tree layout
+ * (Reingold-Tilford) places it in linear time.  As with rankdir=LR, the
+ * depth of a box is its column, and the boxes of a column are stacked
+ * from top to bottom.
+ *
+ * A subtree keeps the top and the bottom of its boxes at each depth, its
+ * contour, and is pushed below its previous siblings as close as their
+ * contours allow.  A merged contour keeps the longer of the two, so the
+ * work is the depth of the shallower one, which adds up to linear time.
+ */
+static bool
+render_graph_native(const node_tree_t *tree, const string& imgfile)
+{
+	native_layout_t layout;
+	writer_t writer;
+	int fd;
+	bool ok;
+
+	layout_native_graph(tree, &layout);
+
+	if (imgfile == "-") {
+		fd = STDOUT_FILENO;
+	} else {
+		fd = open(imgfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0) {
+			write_stderr("%s: could not open file \"%s\" for writing: %m\n",
+						 progname, imgfile.c_str());
+			return false;
+		}
+	}
+
+	writer_init(&writer, fd);
+	write_native_svg(tree, &layout, &writer);
+
+	ok = writer_flush(&writer);
+	if (!ok) {
+		errno = writer.error;
+		write_stderr("%s: could not write file \"%s\": %m\n",
+					 progname, imgfile.c_str());
+	}
+
+	if (fd != STDOUT_FILENO && close(fd) != 0 && ok) {
+		write_stderr("%s: could not close file \"%s\": %m\n",
+					 progname, imgfile.c_str());
+		ok = false;
+	}
+
+	writer_free(&writer);
+
+	return ok;
+}
+
+/*
+ * Find the boxes and the edges between them, the same as
+ * write_dot_script(), and place the boxes.
+ */
+static void
+layout_native_graph(const node_tree_t *tree, native_layout_t *layout)
+{
+	uint32_t nnodes = tree->tag.size();
+	vector<contour_t> contours;
+	vector<long> column_width;
+	vector<long> column_x;
+	string buf;
+	long min_y = 0;
+
+	layout->nodes.clear();
+	layout->parent.assign(nnodes, InvalidNode);
+	layout->first_child.assign(nnodes, InvalidNode);
+	layout->last_child.assign(nnodes, InvalidNode);
+	layout->next_sibling.assign(nnodes, InvalidNode);
+	layout->port.assign(nnodes, 0);
+	layout->depth.assign(nnodes, 0);
+	layout->width.assign(nnodes, 0);
+	layout->height.assign(nnodes, 0);
+	layout->x.assign(nnodes, 0);
+	layout->y.assign(nnodes, 0);
+	layout->first_row.assign(nnodes, 0);
+	layout->nrows.assign(nnodes, 0);
+	layout->rows.clear();
+	layout->lines.clear();
+	layout->text.clear();
+
+	if (nnodes == 0) {
+		return;
+	}
+
+	/* Measure every box once, the SVG writer uses the same geometry. */
+	for (uint32_t node = 0; node < nnodes; node++) {
+		if (is_merged_node(tree, node)) {
+			node = get_subtree_end(tree, node) - 1;
+		} else if (node == 0 || tree->tag[node] == TagNode) {
+			layout->nodes.push_back(node);
+			add_native_rows(tree, node, layout, buf);
+		}
+	}
+
+	/*
+	 * Every node but the root has an incoming edge, which starts from the
+	 * previous element if its parent is a list, otherwise from the row of
+	 * its parent in the enclosing box.  The edges to merged subtrees are
+	 * not part of the tree, they are drawn on top of it.
+	 */
+	layout->merged_edges.clear();
+	for (uint32_t parent = 0; parent < nnodes; parent++) {
+		bool list = tree->tag[parent] == TagList;
+		uint32_t prev = InvalidNode;
+
+		if (is_merged_node(tree, parent)) {
+			parent = get_subtree_end(tree, parent) - 1;
+			continue;
+		}
+
+		for (uint32_t child = tree->first_child[parent];
+			 child != InvalidNode;
+			 prev = child, child = tree->next_sibling[child]) {
+			uint32_t src;
+			uint32_t port;
+
+			if (tree->tag[child] != TagNode) {
+				continue;
+			}
+
+			if (list && hangs_from_prev(tree, prev)) {
+				src = tree->suffix[prev];
+				port = 0;
+			} else {
+				src = tree->suffix[parent];
+				port = tree->index[parent];
+			}
+
+			/* should not happen, hook it to the enclosing box */
+			if (src != 0 && tree->tag[src] != TagNode) {
+				src = parent;
+				while (src != 0 && tree->tag[src] != TagNode) {
+					src = tree->parent[src];
+				}
+				port = 0;
+			}
+
+			if (is_merged_node(tree, child)) {
+				native_edge_t edge;
+
+				edge.src = src;
+				edge.port = port;
+				edge.dst = tree->suffix[child];
+				layout->merged_edges.push_back(edge);
+				continue;
+			}
+
+			layout->parent[child] = src;
+			layout->port[child] = port;
+
+			/*
+			 * The next element of a list hangs from the header, put it
+			 * first.  The rows come in order otherwise.
+			 */
+			if (layout->first_child[src] == InvalidNode) {
+				layout->first_child[src] = child;
+				layout->last_child[src] = child;
+			} else if (port == 0) {
+				layout->next_sibling[child] = layout->first_child[src];
+				layout->first_child[src] = child;
+			} else {
+				layout->next_sibling[layout->last_child[src]] = child;
+				layout->last_child[src] = child;
+			}
+		}
+	}
+
+	/* The sources come before their children, so go backwards. */
+	contours.resize(nnodes);
+	for (size_t i = layout->nodes.size(); i-- > 0;) {
+		uint32_t node = layout->nodes[i];
+		uint32_t first = layout->first_child[node];
+		uint32_t last = first;
+		contour_t *contour = &contours[node];
+		long height = layout->height[node];
+		long top;
+
+		if (first == InvalidNode) {
+			contour->offset = 0;
+			contour->top.assign(1, 0);
+			contour->bottom.assign(1, height);
+			continue;
+		}
+
+		/* Stack the subtrees of the children, y is relative for now. */
+		contour->top.swap(contours[first].top);
+		contour->bottom.swap(contours[first].bottom);
+		contour->offset = contours[first].offset;
+		layout->y[first] = 0;
+
+		for (uint32_t child = layout->next_sibling[first];
+			 child != InvalidNode;
+			 child = layout->next_sibling[child]) {
+			layout->y[child] = merge_contours(contour, &contours[child]);
+			last = child;
+		}
+
+		/* Center the box on its first and last children. */
+		top = (layout->height[first] + layout->y[last] * 2 +
+			   layout->height[last]) / 4 - height / 2;
+
+		for (uint32_t child = first; child != InvalidNode;
+			 child = layout->next_sibling[child]) {
+			layout->y[child] -= top;
+			contours[child].top.clear();
+			contours[child].top.shrink_to_fit();
+			contours[child].bottom.clear();
+			contours[child].bottom.shrink_to_fit();
+		}
+
+		contour->offset -= top;
+		contour->top.push_back(-contour->offset);
+		contour->bottom.push_back(height - contour->offset);
+	}
+
+	/* Now the y of each box, and the width of each column. */
+	for (size_t i = 0; i < layout->nodes.size(); i++) {
+		uint32_t node = layout->nodes[i];
+		uint32_t depth;
+
+		if (node != 0) {
+			layout->y[node] += layout->y[layout->parent[node]];
+			layout->depth[node] = layout->depth[layout->parent[node]] + 1;
+		}
+		depth = layout->depth[node];
+		min_y = min(min_y, layout->y[node]);
+
+		if (column_width.size() <= depth) {
+			column_width.resize(depth + 1, 0);
+		}
+		column_width[depth] = max(column_width[depth], layout->width[node]);
+	}
+
+	column_x.resize(column_width.size());
+	for (size_t depth = 0; depth < column_width.size(); depth++) {
+		column_x[depth] = depth == 0 ? NATIVE_MARGIN :
+			column_x[depth - 1] + column_width[depth - 1] + NATIVE_RANK_SEP;
+	}
+
+	layout->graph_width = 0;
+	layout->graph_height = 0;
+
+	for (size_t i = 0; i < layout->nodes.size(); i++) {
+		uint32_t node = layout->nodes[i];
+		uint32_t depth = layout->depth[node];
+
+		/* center the box in its column */
+		layout->x[node] = column_x[depth] +
+			(column_width[depth] - layout->width[node]) / 2;
+		layout->y[node] += NATIVE_MARGIN - min_y;
+
+		layout->graph_width = max(layout->graph_width,
+								  layout->x[node] + layout->width[node]);
+		layout->graph_height = max(layout->graph_height,
+								   layout->y[node] + layout->height[node]);
+	}
+
+	layout->graph_width += NATIVE_MARGIN;
+	layout->graph_height += NATIVE_MARGIN;
+}
+
+/*
+ * Put the subtree of next below the subtrees merged into acc, as close as
+ * the contours allow, and merge its contour into acc.  Return where the
+ * top of next is relative to acc.
+ */
+static long
+merge_contours(contour_t *acc, contour_t *next)
+{
+	size_t nacc = acc->top.size();
+	size_t nnext = next->top.size();
+	size_t nlevels = min(nacc, nnext);
+	long shift = LONG_MIN;
+
+	/* the levels are kept the deepest first */
+	for (size_t i = 1; i <= nlevels; i++) {
+		long gap = acc->bottom[nacc - i] + acc->offset + NATIVE_NODE_SEP -
+			(next->top[nnext - i] + next->offset);
+
+		shift = max(shift, gap);
+	}
+
+	next->offset += shift;
+
+	if (nnext > nacc) {
+		/* next is deeper, keep its contour with the tops of acc */
+		for (size_t i = 1; i <= nacc; i++) {
+			next->top[nnext - i] = acc->top[nacc - i] + acc->offset -
+				next->offset;
+		}
+		acc->top.swap(next->top);
+		acc->bottom.swap(next->bottom);
+		acc->offset = next->offset;
+	} else {
+		for (size_t i = 1; i <= nnext; i++) {
+			acc->bottom[nacc - i] = next->bottom[nnext - i] + next->offset -
+				acc->offset;
+		}
+	}
+
+	return shift;
+}
+
+/*
+ * Add the rows of the box of a node to the layout: the header, and the
+ * fields which are shown.  Each row is a table cell, sized the way
+ * Graphviz sizes the cells of the HTML table in write_dot_node_body().
+ */
+static void
+add_native_rows(const node_tree_t *tree, uint32_t node,
+				native_layout_t *layout, string& buf)
+{
+	native_row_t *row;
+	long width = 0;
+	long height = 0;
+
+	layout->first_row[node] = layout->rows.size();
+
+	get_display_name(get_node_name(tree, node), buf);
+	row = add_native_row(layout, 0, true);
+	add_native_line(layout, row, buf.data(), buf.size(), true, AlignCenter, 0);
+	finish_native_row(row);
+	width = row->width;
+	height = row->height;
+
+	for (uint32_t child = tree->first_child[node];
+		 child != InvalidNode;
+		 child = tree->next_sibling[child]) {
+		span_t name = get_node_name(tree, child);
+
+		/* Do not show empty fields if enable skip empty. */
+		if (enable_skip_empty && name_contains_empty(name)) {
+			continue;
+		}
+
+		get_display_name(name, buf);
+		row = add_native_row(layout, tree->index[child], false);
+		row->top = height;
+
+		if (memmem(name.ptr, name.len, "colnames", 8) != NULL &&
+			buf != "colnames --") {
+			add_native_colnames(layout, row, buf);
+		} else {
+			add_native_line(layout, row, buf.data(), buf.size(), false,
+							AlignCenter, 0);
+		}
+
+		finish_native_row(row);
+		width = max(width, row->width);
+		height += row->height;
+	}
+
+	layout->nrows[node] = layout->rows.size() - layout->first_row[node];
+	layout->width[node] = width;
+	layout->height[node] = height;
+}
+
+static native_row_t *
+add_native_row(native_layout_t *layout, uint32_t index, bool header)
+{
+	native_row_t row;
+
+	row.index = index;
+	row.header = header;
+	row.first_line = layout->lines.size();
+	row.nlines = 0;
+	row.top = 0;
+	row.text_width = 0;
+	row.width = 0;
+	row.height = 0;
+
+	layout->rows.push_back(row);
+
+	return &layout->rows.back();
+}
+
+/*
+ * Add a line of text to the row.  The line is centered in the cell, or
+ * within [0, span) of it, or starts at span if it is aligned left.
+ */
+static void
+add_native_line(native_layout_t *layout, native_row_t *row, const char *text,
+				size_t len, bool bold, native_align_t align, long span)
+{
+	native_line_t line;
+
+	line.offset = layout->text.size();
+	line.len = len;
+	line.width = get_text_width(text, len, bold);
+	line.align = align;
+	line.span = span;
+
+	layout->text.append(text, len);
+	layout->lines.push_back(line);
+
+	row->nlines++;
+	if (align == AlignLeft) {
+		row->text_width = max(row->text_width,
+								 span + line.width + NATIVE_CELL_PADDING);
+	} else {
+		row->text_width = max(row->text_width, max(span, line.width));
+	}
+}
+
+/*
+ * Add the column names as a two-column table, the same as
+ * write_colnames(): the opening and the closing parts in the first
+ * column, and the names aligned left in the second.
+ */
+static void
+add_native_colnames(native_layout_t *layout, native_row_t *row,
+					const string& name)
+{
+	const char *p;
+	const char *end = name.data() + name.size();
+	size_t pos;
+	const char *last;
+	long first_width;
+
+	pos = name.find("(");
+	pos = (pos == string::npos) ? 0 : pos + 1;
+
+	p = name.data() + pos;
+	while (p < end && isspace(*p)) {
+		p++;
+	}
+
+	/* the first column is as wide as the opening or the closing part */
+	last = (const char *) memrchr(p, ' ', end - p);
+	if (last == NULL) {
+		last = p;
+	} else {
+		while (last < end && isspace(*last)) {
+			last++;
+		}
+	}
+	first_width = max(get_text_width(name.data(), pos, false),
+					  get_text_width(last, end - last, false));
+	first_width += 2 * NATIVE_CELL_PADDING;
+
+	add_native_line(layout, row, name.data(), pos, false, AlignCenter,
+					first_width);
+
+	for (;;) {
+		const char *space = (const char *) memchr(p, ' ', end - p);
+		const char *t;
+
+		if (space == NULL) {
+			break;
+		}
+
+		t = space;
+		while (t > p && isspace(t[-1])) {
+			t--;
+		}
+
+		add_native_line(layout, row, p, t - p, false, AlignLeft,
+						first_width + NATIVE_CELL_PADDING);
+
+		p = space + 1;
+		while (p < end && isspace(*p)) {
+			p++;
+		}
+	}
+
+	if (p < end) {
+		add_native_line(layout, row, p, end - p, false, AlignCenter,
+						first_width);
+	}
+}
+
+static void
+finish_native_row(native_row_t *row)
+{
+	row->width = row->text_width + 2 * NATIVE_CELL_PADDING;
+	row->height = row->nlines * NATIVE_LINE_HEIGHT + 2 * NATIVE_CELL_PADDING;
+}
+
+/*
+ * The width of a text with the metrics of Times, which is what Graphviz
+ * uses by default.  Characters out of ASCII are taken as an average one.
+ */
+static long
+get_text_width(const char *text, size_t len, bool bold)
+{
+	const uint16_t *widths = bold ? times_bold_widths : times_roman_widths;
+	unsigned long units = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = text[i];
+
+		if (c >= 0x20 && c < 0x7f) {
+			units += widths[c - 0x20];
+		} else if (c >= 0xc0) {
+			/* the first byte of a UTF-8 character */
+			units += NATIVE_DEFAULT_CHAR_WIDTH;
+		}
+	}
+
+	return (units * NATIVE_FONT_SIZE + 999) / 1000;
+}
+
+/*
+ * Write the boxes and the edges as SVG, in one pass over the boxes with
+ * the geometry of the layout.
+ */
+static void
+write_native_svg(const node_tree_t *tree, const native_layout_t *layout,
+				 writer_t *w)
+{
+	string buf;
+
+	put_literal(w,
+				"<?xml version=\"1.0\" encoding=\"UTF-8\" standalone=\"no\"?>\n"
+				"<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"");
+	put_uint(w, layout->graph_width);
+	put_literal(w, "pt\" height=\"");
+	put_uint(w, layout->graph_height);
+	put_literal(w, "pt\" viewBox=\"0 0 ");
+	put_uint(w, layout->graph_width);
+	put_literal(w, " ");
+	put_uint(w, layout->graph_height);
+	put_literal(w,
+				"\">\n"
+				"<defs>\n");
+	write_native_arrow(w, "arrow", "black");
+	write_native_arrow(w, "arrow_blue", "blue");
+	write_native_arrow(w, "arrow_green", "green");
+	put_literal(w,
+				"</defs>\n"
+				"<rect width=\"100%\" height=\"100%\" fill=\"white\"/>\n"
+				"<g font-family=\"Times,serif\" font-size=\"");
+	put_uint(w, NATIVE_FONT_SIZE);
+	put_literal(w, "\">\n");
+
+	for (size_t i = 0; i < layout->nodes.size(); i++) {
+		uint32_t node = layout->nodes[i];
+
+		write_native_node(tree, layout, node, buf, w);
+		write_native_edges(tree, layout, node, w);
+	}
+
+	for (size_t i = 0; i < layout->merged_edges.size(); i++) {
+		const native_edge_t *edge = &layout->merged_edges[i];
+
+		write_native_edge(layout, edge->src, edge->port, edge->dst, false, w);
+	}
+
+	put_literal(w,
+				"</g>\n"
+				"</svg>\n");
+}
+
+static void
+write_native_arrow(writer_t *w, const char *id, const char *color)
+{
+	put_literal(w, "<marker id=\"");
+	put_bytes(w, id, strlen(id));
+	put_literal(w,
+				"\" viewBox=\"0 0 10 10\" refX=\"10\" refY=\"5\" "
+				"markerWidth=\"8\" markerHeight=\"8\" orient=\"auto\">"
+				"<path d=\"M0,0 L10,5 L0,10 z\" fill=\"");
+	put_bytes(w, color, strlen(color));
+	put_literal(w, "\"/></marker>\n");
+}
+
+/*
+ * Write a box as a rect for each cell and a text for each line, the buf
+ * is a scratch space.
+ */
+static void
+write_native_node(const node_tree_t *tree, const native_layout_t *layout,
+				  uint32_t node, string& buf, writer_t *w)
+{
+	const native_row_t *rows = &layout->rows[layout->first_row[node]];
+	const node_color_t *colors = NULL;
+	long x = layout->x[node];
+	long y = layout->y[node];
+	long width = layout->width[node];
+
+	if (enable_color) {
+		const native_line_t *line = &layout->lines[rows[0].first_line];
+
+		buf.assign(layout->text, line->offset, line->len);
+		auto it = node_color_mapping.find(buf);
+		if (it != node_color_mapping.end()) {
+			colors = &it->second;
+		}
+	}
+
+	put_literal(w, "<g id=\"node_");
+	put_uint(w, tree->suffix[node]);
+	put_literal(w, "\">\n");
+
+	for (uint32_t i = 0; i < layout->nrows[node]; i++) {
+		const native_row_t *row = &rows[i];
+		bool filled = row->header && colors != NULL &&
+			!colors->bgcolor.empty();
+
+		put_literal(w, "<rect x=\"");
+		put_uint(w, x);
+		put_literal(w, "\" y=\"");
+		put_uint(w, y);
+		put_literal(w, "\" width=\"");
+		put_uint(w, width);
+		put_literal(w, "\" height=\"");
+		put_uint(w, row->height);
+		put_literal(w, "\" fill=\"");
+		if (filled) {
+			put_svg_text(w, colors->bgcolor.data(), colors->bgcolor.size());
+		} else {
+			put_literal(w, "none");
+		}
+		put_literal(w, "\" stroke=\"");
+		if (filled) {
+			put_svg_text(w, colors->bgcolor.data(), colors->bgcolor.size());
+		} else {
+			put_literal(w, "black");
+		}
+		put_literal(w, "\"/>\n");
+
+		for (uint32_t j = 0; j < row->nlines; j++) {
+			const native_line_t *line = &layout->lines[row->first_line + j];
+			long text_x = x + NATIVE_CELL_PADDING;
+
+			/* the text area of a cell is centered as Graphviz does */
+			text_x += (width - row->width) / 2;
+			if (line->align == AlignLeft) {
+				text_x += line->span;
+			} else if (line->span > 0) {
+				text_x += (line->span - line->width) / 2;
+			} else {
+				text_x += (row->text_width - line->width) / 2;
+			}
+
+			put_literal(w, "<text x=\"");
+			put_uint(w, text_x);
+			put_literal(w, "\" y=\"");
+			put_uint(w, y + NATIVE_CELL_PADDING + j * NATIVE_LINE_HEIGHT +
+					 NATIVE_FONT_SIZE);
+			put_literal(w, "\"");
+			if (row->header) {
+				put_literal(w, " font-weight=\"bold\"");
+				if (colors != NULL && !colors->fontcolor.empty()) {
+					put_literal(w, " fill=\"");
+					put_svg_text(w, colors->fontcolor.data(),
+								 colors->fontcolor.size());
+					put_literal(w, "\"");
+				}
+			}
+			put_literal(w, ">");
+			put_svg_text(w, layout->text.data() + line->offset, line->len);
+			put_literal(w, "</text>\n");
+		}
+
+		y += row->height;
+	}
+
+	put_literal(w, "</g>\n");
+}
+
+/*
+ * Write the edges to the children of a box, from the right of the row each
+ * of them hangs from, to the left of the header of the child.
+ */
+static void
+write_native_edges(const node_tree_t *tree, const native_layout_t *layout,
+				   uint32_t node, writer_t *w)
+{
+	for (uint32_t child = layout->first_child[node];
+		 child != InvalidNode;
+		 child = layout->next_sibling[child]) {
+		bool list = tree->tag[tree->parent[child]] == TagList;
+
+		write_native_edge(layout, node, layout->port[child], child, list, w);
+	}
+}
+
+static void
+write_native_edge(const native_layout_t *layout, uint32_t src, uint32_t port,
+				  uint32_t dst, bool list, writer_t *w)
+{
+	const native_row_t *rows = &layout->rows[layout->first_row[src]];
+	const native_row_t *end = rows + layout->nrows[src];
+	const native_row_t *row;
+	long x1 = layout->x[src] + layout->width[src];
+	long x2 = layout->x[dst];
+	long y1;
+	long y2 = layout->y[dst] + layout->rows[layout->first_row[dst]].height / 2;
+	long bend = (x2 - x1) / 2;
+
+	/* the rows are in the order of their index */
+	row = lower_bound(rows, end, port,
+					  [](const native_row_t& r, uint32_t index) {
+						  return r.index < index;
+					  });
+
+	/* an unknown port is the header, as in dot */
+	if (row == end || row->index != port) {
+		row = rows;
+	}
+	y1 = layout->y[src] + row->top + row->height / 2;
+
+	put_literal(w, "<path d=\"M");
+	put_uint(w, x1);
+	put_literal(w, ",");
+	put_uint(w, y1);
+	put_literal(w, " C");
+	put_uint(w, x1 + bend);
+	put_literal(w, ",");
+	put_uint(w, y1);
+	put_literal(w, " ");
+	put_uint(w, x2 - bend);
+	put_literal(w, ",");
+	put_uint(w, y2);
+	put_literal(w, " ");
+	put_uint(w, x2);
+	put_literal(w, ",");
+	put_uint(w, y2);
+
+	if (!enable_color) {
+		put_literal(w, "\" fill=\"none\" stroke=\"black\" "
+					"marker-end=\"url(#arrow)\"/>\n");
+	} else if (list) {
+		put_literal(w, "\" fill=\"none\" stroke=\"blue\" "
+					"marker-end=\"url(#arrow_blue)\"/>\n");
+	} else {
+		put_literal(w, "\" fill=\"none\" stroke=\"green\" "
+					"marker-end=\"url(#arrow_green)\"/>\n");
+	}
+}
+
+/*
+ * Write a text with the XML special characters escaped.
+ */
+static void
+put_svg_text(writer_t *w, const char *text, size_t len)
+{
+	const char *p = text;
+	const char *end = text + len;
+	const char *start = p;
+
+	for (; p < end; p++) {
+		const char *entity;
+
+		switch (*p) {
+		case '&':
+			entity = "&amp;";
+			break;
+		case '<':
+			entity = "&lt;";
+			break;
+		case '>':
+			entity = "&gt;";
+			break;
+		case '"':
+			entity = "&quot;";
+			break;
+		default:
+			continue;
+		}
+
+		put_bytes(w, start, p - start);
+		put_bytes(w, entity, strlen(entity));
+		start = p + 1;
+	}
+
+	put_bytes(w, start, p - start);
+}
+
+/*
+ * Parse a whole node tree in memory.  The names refer to the input, so it
+ * must be kept as long as the tree.
+ */
+static bool
+parse_pg_node_tree(const input_t *input, node_tree_t *tree)
+{
+	node_parser_t parser;
+
+	init_node_parser(&parser, tree);
+
+	return feed_node_parser(&parser, input->data, input->size) == ParseComplete;
+}
+
+static void
+init_node_parser(node_parser_t *parser, node_tree_t *tree)
+{
+	parser->tree = tree;
+	parser->data = NULL;
+	parser->size = 0;
+	parser->copied = false;
+	parser->buf.clear();
+	parser->pos = 0;
+	while (!parser->nodes_stack.empty()) {
+		parser->nodes_stack.pop();
+	}
+	parser->prev_is_item = false;
+	parser->name_token = 0;
+	parser->name_start = 0;
+	parser->depth = 0;
+	parser->skip_depth = 0;
+	parser->skip_count = false;
+	parser->skip_field = false;
+	parser->placeholder = InvalidNode;
+	parser->nhidden = 0;
+	parser->hidden_types.clear();
+	parser->hidden_names.clear();
+	parser->normalized_names.clear();
+}
+
+/*
+ * Feed the next chunk of the input to the parser.
+ *
+ * A chunk may end anywhere, even in the middle of a name.  Return
+ * ParseNeedMore until the root node is closed; the tree refers to the
+ * parser's copy of the input then, so keep the parser as long as the tree.
+ * The first chunk is parsed in place if it holds the whole tree, which is
+ * the case of a file in memory.  Anything after the root node is left
+ * alone, parser->pos is where it starts.
+ */
+static parse_result_t
+feed_node_parser(node_parser_t *parser, const char *chunk, size_t len)
+{
+	parse_result_t rc;
+
+	if (parser->size == 0) {
+		parser->data = chunk;
+		parser->size = len;
+	} else {
+		if (!parser->copied) {
+			parser->buf.assign(parser->data, parser->size);
+			parser->copied = true;
+		}
+		parser->buf.append(chunk, len);
+		parser->data = parser->buf.data();
+		parser->size = parser->buf.size();
+	}
+
+	rc = run_node_parser(parser);
+
+	/* The chunk is the caller's, keep what we have read of it. */
+	if (rc == ParseNeedMore && !parser->copied && parser->size > 0) {
+		parser->buf.assign(parser->data, parser->size);
+		parser->data = parser->buf.data();
+		parser->copied = true;
+	}
+
+	return rc;
+}
+
+/*
+ * Parse the input from where we stopped last time, until we run out of it
+ * or the root node is closed.
+ */
+static parse_result_t
+run_node_parser(node_parser_t *parser)
+{
+	node_tree_t *tree = parser->tree;
+	stack<uint32_t>& nodes_stack = parser->nodes_stack;
+	const char *data = parser->data;
+	scanner_t sc;
+	const char *token;
+	uint32_t top;
+
+	/* our copy of the input may have moved */
+	tree->base = data;
+	scanner_init(&sc, data + parser->pos, data + parser->size);
+
+	for (;;) {
+		if (parser->name_token != 0) {
+			const char *resume;
+			span_t name;
+
+			/* the token that terminates the name */
+			token = get_pg_node_name(&sc, &resume);
+			if (token == NULL) {
+				parser->pos = resume - data;
+				return ParseNeedMore;
+			}
+
+			name.ptr = data + parser->name_start;
+			name.len = token - name.ptr;
+
+			if (!add_named_node(parser, name)) {
+				return ParseError;
+			}
+		} else {
+			token = scanner_next(&sc);
+			if (token == NULL) {
+				parser->pos = parser->size;
+				return ParseNeedMore;
+			}
+		}
+
+		if (parser->skip_depth > 0) {
+			if (!skip_node_token(parser, token)) {
+				parser->pos = token - data;
+				return ParseNeedMore;
+			}
+			continue;
+		}
+
+		switch (*token) {
+		case '{':
+		case ':':
+			{
+				/* the node is added once we have its name */
+				parser->name_token = *token;
+				parser->name_start = token + 1 - data;
+				break;
+			}
+		case '}':
+			{
+				if (nodes_stack.empty()) {
+					return ParseError;
+				}
+
+				add_placeholder(parser);
+
+				top = nodes_stack.top();
+				if (top == InvalidNode) {
+					return ParseError;
+				}
+
+				nodes_stack.pop();
+				parser->prev_is_item = false;
+				parser->skip_field = false;
+				if (tree->tag[top] == TagNode) {
+					parser->depth--;
+				}
+
+#ifdef DEBUG
+				span_t name = get_node_name(tree, top);
+				write_stderr("STACK: node pop %.*s from stack %u\n",
+							 (int) name.len, name.ptr, nodes_stack.size());
+#endif
+				if (nodes_stack.empty()) {
+					parser->pos = token + 1 - data;
+					return ParseComplete;
+				}
+
+				break;
+			}
+		case '(':
+			{
+				uint32_t node;
+
+				if (nodes_stack.empty()) {
+					return ParseError;
+				}
+
+				top = nodes_stack.top();
+
+				/* the list of a filtered field, skip its elements */
+				if (parser->skip_field || top == InvalidNode) {
+					nodes_stack.push(InvalidNode);
+					parser->skip_field = false;
+					break;
+				}
+
+				node = tree->last_child[top];
+
+				if (node == InvalidNode) {
+					return ParseError;
+				}
+
+				tree->tag[node] = TagList;
+				tree->suffix[node] = tree->suffix[top];
+
+				nodes_stack.push(node);
+				parser->prev_is_item = false;
+
+#ifdef DEBUG
+				span_t name = get_node_name(tree, top);
+				write_stderr("STACK: list push %.*s at stack %u\n",
+							 (int) name.len, name.ptr, nodes_stack.size());
+#endif
+				break;
+			}
+		case ')':
+			{
+				if (nodes_stack.empty()) {
+					return ParseError;
+				}
+
+				add_placeholder(parser);
+
+				top = nodes_stack.top();
+				nodes_stack.pop();
+				parser->prev_is_item = false;
+				parser->skip_field = false;
+				if (top == InvalidNode) {
+					break;
+				}
+
+#ifdef DEBUG
+				span_t name = get_node_name(tree, top);
+				write_stderr("STACK: list pop %.*s from stack %u\n",
+							 (int) name.len, name.ptr, nodes_stack.size());
+#endif
+
+				break;
+			}
+		default:
+			{
+				/* ignore */
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Add the node or the field whose name we have just read.
+ */
+static bool
+add_named_node(node_parser_t *parser, const span_t& name)
+{
+	node_tree_t *tree = parser->tree;
+	stack<uint32_t>& nodes_stack = parser->nodes_stack;
+	uint32_t top;
+	uint32_t node;
+
+	bool skip_field = parser->skip_field;
+
+	parser->skip_field = false;
+
+	if (parser->name_token == '{') {
+		if (!nodes_stack.empty() &&
+			(skip_field || nodes_stack.top() == InvalidNode ||
+			 is_filtered_node(parser, name))) {
+			skip_node(parser);
+			return true;
+		}
+
+		if (!nodes_stack.empty() && is_hidden_node(parser)) {
+			hide_node(parser, name);
+			return true;
+		}
+
+		add_placeholder(parser);
+
+		node = add_node(tree, TagNode, name);
+
+		if (!nodes_stack.empty()) {
+			top = nodes_stack.top();
+			if (parser->prev_is_item) {
+				uint32_t item = tree->last_child[top];
+
+				assert(item != InvalidNode);
+
+				tree->tag[item] = TagHide;
+				tree->suffix[item] = tree->suffix[top];
+				top = item;
+			}
+
+			append_node(tree, top, node);
+		}
+
+		nodes_stack.push(node);
+		parser->prev_is_item = false;
+		parser->depth++;
+
+#ifdef DEBUG
+		write_stderr("STACK: node push %.*s at stack %u\n",
+					 (int) name.len, name.ptr, nodes_stack.size());
+#endif
+	} else {
+		if (nodes_stack.empty() || nodes_stack.top() == InvalidNode) {
+			return false;
+		}
+
+		if (is_filtered_field(parser, name)) {
+			parser->skip_field = true;
+			parser->prev_is_item = false;
+			parser->name_token = 0;
+			return true;
+		}
+
+		add_placeholder(parser);
+
+		node = add_node(tree, TagItem, name);
+
+		if (match_field(parser, name, normalize_fields)) {
+			normalize_field(parser, node, name);
+		}
+
+		/* get top node and push current node in its elems */
+		append_node(tree, nodes_stack.top(), node);
+		parser->prev_is_item = true;
+	}
+
+	parser->name_token = 0;
+
+	return true;
+}
+
+/*
+ * Whether the node we are adding is beyond --max-depth, or beyond
+ * --max-children in its list.
+ */
+static bool
+is_hidden_node(const node_parser_t *parser)
+{
+	const node_tree_t *tree = parser->tree;
+	uint32_t top = parser->nodes_stack.top();
+	uint32_t last;
+
+	if (max_depth > 0 && parser->depth >= max_depth) {
+		return true;
+	}
+
+	if (max_children > 0 && tree->tag[top] == TagList) {
+		last = tree->last_child[top];
+		return last != InvalidNode && tree->index[last] >= max_children;
+	}
+
+	return false;
+}
+
+/*
+ * Skip the subtree of the node we are adding, and count it in the
+ * placeholder that stands for it.  The rest of the elements of a list go
+ * to the same placeholder.
+ */
+static void
+hide_node(node_parser_t *parser, const span_t& name)
+{
+	node_tree_t *tree = parser->tree;
+	uint32_t top = parser->nodes_stack.top();
+	span_t type;
+
+	if (parser->placeholder == InvalidNode ||
+		tree->last_child[top] != parser->placeholder) {
+		span_t empty = { tree->base, 0 };
+
+		add_placeholder(parser);
+
+		parser->placeholder = add_node(tree, TagNode, empty);
+
+		if (parser->prev_is_item) {
+			uint32_t item = tree->last_child[top];
+
+			tree->tag[item] = TagHide;
+			tree->suffix[item] = tree->suffix[top];
+			top = item;
+		}
+
+		append_node(tree, top, parser->placeholder);
+	}
+
+	type = get_node_type(name.ptr, name.ptr + name.len);
+	count_hidden_node(parser, type);
+
+	parser->skip_depth = 1;
+	parser->skip_count = true;
+	parser->prev_is_item = false;
+	parser->name_token = 0;
+}
+
+/*
+ * Skip the subtree of the node we are adding, without a trace.
+ */
+static void
+skip_node(node_parser_t *parser)
+{
+	parser->skip_depth = 1;
+	parser->skip_count = false;
+	parser->prev_is_item = false;
+	parser->name_token = 0;
+}
+
+/*
+ * Whether the node we are adding is left out by --include or --exclude,
+ * the root never is.
+ */
+static bool
+is_filtered_node(node_parser_t *parser, const span_t& name)
+{
+	span_t type;
+
+	if (include_types.empty() && exclude_types.empty()) {
+		return false;
+	}
+
+	type = get_node_type(name.ptr, name.ptr + name.len);
+	parser->type.assign(type.ptr, type.len);
+
+	if (!include_types.empty() &&
+		include_types.find(parser->type) == include_types.end()) {
+		return true;
+	}
+
+	return exclude_types.find(parser->type) != exclude_types.end();
+}
+
+/*
+ * Whether the field we are adding is left out by --exclude, as a field of
+ * any node, or of the node it is in.
+ */
+static bool
+is_filtered_field(node_parser_t *parser, const span_t& name)
+{
+	return match_field(parser, name, exclude_fields);
+}
+
+/*
+ * Is the field in name, of the node on the top of the stack, one of fields
+ * (":field" or "TYPE:field")?
+ */
+static bool
+match_field(node_parser_t *parser, const span_t& name,
+			const set<string>& fields)
+{
+	const node_tree_t *tree = parser->tree;
+	uint32_t top = parser->nodes_stack.top();
+	span_t field;
+	span_t node_name;
+	span_t type;
+
+	if (fields.empty() || tree->tag[top] != TagNode) {
+		return false;
+	}
+
+	field = get_node_type(name.ptr, name.ptr + name.len);
+	parser->type.assign(":");
+	parser->type.append(field.ptr, field.len);
+	if (fields.find(parser->type) != fields.end()) {
+		return true;
+	}
+
+	node_name = get_node_name(tree, top);
+	type = get_node_type(node_name.ptr, node_name.ptr + node_name.len);
+	parser->type.insert(0, type.ptr, type.len);
+
+	return fields.find(parser->type) != fields.end();
+}
+
+/*
+ * Replace the value of a field with "?", so trees which differ only in it
+ * get the same picture, the same cache key and merge with -M.  A field
+ * whose value is a node or a list keeps it, that is the next token.
+ */
+static void
+normalize_field(node_parser_t *parser, uint32_t node, const span_t& name)
+{
+	node_tree_t *tree = parser->tree;
+	span_t field = get_node_type(name.ptr, name.ptr + name.len);
+	const char *value = field.ptr + field.len;
+	const char *end = name.ptr + name.len;
+	string key(field.ptr, field.len);
+	map<string, uint64_t>::iterator it;
+
+	while (value < end && isspace(*value)) {
+		value++;
+	}
+	if (value == end) {
+		return;
+	}
+
+	it = parser->normalized_names.find(key);
+
+	/* the fields of the same name share their new name */
+	if (it == parser->normalized_names.end()) {
+		uint64_t off = tree->extra_names.size() | ExtraName;
+
+		tree->extra_names.append(key);
+		tree->extra_names.append(" ?");
+		it = parser->normalized_names.insert(make_pair(key, off)).first;
+	}
+
+	tree->name_off[node] = it->second;
+	tree->name_len[node] = field.len + 2;
+}
+
+/*
+ * Count the nodes in a hidden subtree, until its closing brace.  Only the
+ * braces matter here, return false if we need more input to get the type of
+ * a node.
+ */
+static bool
+skip_node_token(node_parser_t *parser, const char *token)
+{
+	const char *end = parser->data + parser->size;
+	span_t type;
+
+	switch (*token) {
+	case '{':
+		{
+			if (!parser->skip_count) {
+				parser->skip_depth++;
+				break;
+			}
+
+			type = get_node_type(token + 1, end);
+			if (type.ptr + type.len == end) {
+				return false;
+			}
+
+			count_hidden_node(parser, type);
+			parser->skip_depth++;
+			break;
+		}
+	case '}':
+		{
+			parser->skip_depth--;
+			break;
+		}
+	default:
+		{
+			/* ignore */
+			break;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * The type of a node is the first word of its name.
+ */
+static span_t
+get_node_type(const char *p, const char *end)
+{
+	span_t type;
+
+	while (p < end && isspace(*p)) {
+		p++;
+	}
+
+	type.ptr = p;
+	while (p < end && !isspace(*p) && strchr("{}():", *p) == NULL) {
+		p++;
+	}
+	type.len = p - type.ptr;
+
+	return type;
+}
+
+/*
+ * Count a node hidden by the pending placeholder.  There are only a few
+ * types in a subtree, and skipping a huge one should not allocate for each
+ * node, so they are searched in a vector whose memory is kept.
+ */
+static void
+count_hidden_node(node_parser_t *parser, span_t type)
+{
+	const char *names = parser->hidden_names.data();
+	hidden_type_t hidden;
+
+	parser->nhidden++;
+
+	for (size_t i = 0; i < parser->hidden_types.size(); i++) {
+		hidden_type_t *t = &parser->hidden_types[i];
+
+		if (t->len == type.len &&
+			memcmp(names + t->off, type.ptr, type.len) == 0) {
+			t->count++;
+			return;
+		}
+	}
+
+	hidden.off = parser->hidden_names.size();
+	hidden.len = type.len;
+	hidden.count = 1;
+	parser->hidden_types.push_back(hidden);
+	parser->hidden_names.append(type.ptr, type.len);
+}
+
+/*
+ * Name the pending placeholder after the number of nodes it hides, and add
+ * a row for each type of them, the most common first, then by name.
+ */
+static void
+add_placeholder(node_parser_t *parser)
+{
+	node_tree_t *tree = parser->tree;
+	uint32_t node = parser->placeholder;
+	vector<hidden_type_t>& types = parser->hidden_types;
+	const string& names = parser->hidden_names;
+	span_t empty = { tree->base, 0 };
+	char buf[64];
+	int len;
+
+	if (node == InvalidNode) {
+		return;
+	}
+
+	len = snprintf(buf, sizeof(buf), "%u hidden node%s", parser->nhidden,
+				   parser->nhidden == 1 ? "" : "s");
+	tree->name_off[node] = tree->extra_names.size() | ExtraName;
+	tree->name_len[node] = len;
+	tree->extra_names.append(buf, len);
+
+	sort(types.begin(), types.end(),
+		 [&names](const hidden_type_t& a, const hidden_type_t& b) {
+			 if (a.count != b.count) {
+				 return a.count > b.count;
+			 }
+			 return names.compare(a.off, a.len, names, b.off, b.len) < 0;
+		 });
+
+	for (size_t i = 0; i < types.size(); i++) {
+		uint32_t item = add_node(tree, TagItem, empty);
+
+		len = snprintf(buf, sizeof(buf), " %u", types[i].count);
+		tree->name_off[item] = tree->extra_names.size() | ExtraName;
+		tree->name_len[item] = types[i].len + len;
+		tree->extra_names.append(names, types[i].off, types[i].len);
+		tree->extra_names.append(buf, len);
+
+		append_node(tree, node, item);
+	}
+
+	parser->placeholder = InvalidNode;
+	parser->nhidden = 0;
+	parser->hidden_types.clear();
+	parser->hidden_names.clear();
+}
+
+static void
+init_node_tree(node_tree_t *tree)
+{
+	tree->base = NULL;
+}
+
+static void
+free_node_tree(node_tree_t *tree)
+{
+	tree->base = NULL;
+	tree->tag.clear();
+	tree->name_off.clear();
+	tree->name_len.clear();
+	tree->parent.clear();
+	tree->first_child.clear();
+	tree->last_child.clear();
+	tree->next_sibling.clear();
+	tree->index.clear();
+	tree->suffix.clear();
+	tree->shared.clear();
+	tree->extra_names.clear();
+}
+
+/*
+ * Add a new node without parent, its suffix is the node number.
+ */
+static uint32_t
+add_node(node_tree_t *tree, tag_t tag, const span_t& name)
+{
+	uint32_t node = tree->tag.size();
+
+	tree->tag.push_back(tag);
+	tree->name_off.push_back(name.ptr - tree->base);
+	tree->name_len.push_back(name.len);
+	tree->parent.push_back(InvalidNode);
+	tree->first_child.push_back(InvalidNode);
+	tree->last_child.push_back(InvalidNode);
+	tree->next_sibling.push_back(InvalidNode);
+	tree->index.push_back(0);
+	tree->suffix.push_back(node);
+
+	return node;
+}
+
+/*
+ * Append the node to the elems of parent, its index starts from 1, since
+ * the field 0 in the dot node is the name of parent.
+ */
+static void
+append_node(node_tree_t *tree, uint32_t parent, uint32_t node)
+{
+	uint32_t last = tree->last_child[parent];
+
+	if (last == InvalidNode) {
+		tree->first_child[parent] = node;
+		tree->index[node] = 1;
+	} else {
+		tree->next_sibling[last] = node;
+		tree->index[node] = tree->index[last] + 1;
+	}
+
+	tree->last_child[parent] = node;
+	tree->parent[node] = parent;
+}
+
+static span_t
+get_node_name(const node_tree_t *tree, uint32_t node)
+{
+	span_t name;
+
+	if (tree->name_off[node] & ExtraName) {
+		name.ptr = tree->extra_names.data() +
+			(tree->name_off[node] & ~ExtraName);
+	} else {
+		name.ptr = tree->base + tree->name_off[node];
+	}
+	name.len = tree->name_len[node];
+
+	return name;
+}
+
+/*
+ * Merge the subtrees which are the same.  A node whose subtree was seen
+ * before takes the suffix of the first one, so the edge to it goes there,
+ * and its subtree is not written.  The elements of a list are merged too,
+ * the next element then hangs from the row of the list, see
+ * hangs_from_prev().
+ *
+ * Two nodes are the same if they have the same tag and name (without the
+ * indentation around it), and their children are the same, so we number
+ * the classes of the subtrees from the leaves up, and compare the classes
+ * of the children rather than their subtrees.
+ */
+static void
+merge_subtrees(node_tree_t *tree)
+{
+	uint32_t nnodes = tree->tag.size();
+	vector<uint32_t> klass(nnodes);
+	vector<uint32_t> chain(nnodes, InvalidNode);
+	vector<uint32_t> first(nnodes, InvalidNode);
+	unordered_map<uint64_t, uint32_t> classes;
+
+	classes.reserve(nnodes);
+	tree->shared.assign(nnodes, false);
+
+	/* The children come after their parents, so go backwards. */
+	for (uint32_t node = nnodes; node-- > 0;) {
+		uint64_t hash = hash_node(tree, node, klass);
+		auto it = classes.find(hash);
+
+		klass[node] = node;
+
+		if (it == classes.end()) {
+			classes.emplace(hash, node);
+			continue;
+		}
+
+		for (uint32_t other = it->second; other != InvalidNode;
+			 other = chain[other]) {
+			if (same_node(tree, node, other, klass)) {
+				klass[node] = other;
+				break;
+			}
+		}
+
+		/* a new class with the same hash */
+		if (klass[node] == node) {
+			chain[node] = it->second;
+			it->second = node;
+		}
+	}
+
+	/*
+	 * Then hook every node to the first node of its class which is shown,
+	 * the root is never merged.
+	 */
+	for (uint32_t node = 1; node < nnodes;) {
+		uint32_t k = klass[node];
+
+		if (tree->tag[node] != TagNode) {
+			node++;
+		} else if (first[k] == InvalidNode) {
+			first[k] = node;
+			node++;
+		} else {
+			tree->suffix[node] = first[k];
+			tree->shared[first[k]] = true;
+			node = get_subtree_end(tree, node);
+		}
+	}
+}
+
+/*
+ * Hash the tag and the name of a node, and the classes of its children
+ * (FNV-1a).
+ */
+static uint64_t
+hash_node(const node_tree_t *tree, uint32_t node,
+		  const vector<uint32_t>& klass)
+{
+	span_t name = get_trimmed_name(tree, node);
+	uint64_t hash = 14695981039346656037ULL;
+
+	hash = (hash ^ tree->tag[node]) * 1099511628211ULL;
+	for (size_t i = 0; i < name.len; i++) {
+		hash = (hash ^ (unsigned char) name.ptr[i]) * 1099511628211ULL;
+	}
+
+	for (uint32_t child = tree->first_child[node];
+		 child != InvalidNode;
+		 child = tree->next_sibling[child]) {
+		hash = (hash ^ klass[child]) * 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static bool
+same_node(const node_tree_t *tree, uint32_t a, uint32_t b,
+		  const vector<uint32_t>& klass)
+{
+	span_t name_a = get_trimmed_name(tree, a);
+	span_t name_b = get_trimmed_name(tree, b);
+
+	if (tree->tag[a] != tree->tag[b] || name_a.len != name_b.len ||
+		memcmp(name_a.ptr, name_b.ptr, name_a.len) != 0) {
+		return false;
+	}
+
+	a = tree->first_child[a];
+	b = tree->first_child[b];
+	while (a != InvalidNode && b != InvalidNode) {
+		if (klass[a] != klass[b]) {
+			return false;
+		}
+		a = tree->next_sibling[a];
+		b = tree->next_sibling[b];
+	}
+
+	return a == b;
+}
+
+/*
+ * The nodes of a subtree are numbered in a row, return the number after
+ * its last node.
+ */
+static uint32_t
+get_subtree_end(const node_tree_t *tree, uint32_t node)
+{
+	while (tree->last_child[node] != InvalidNode) {
+		node = tree->last_child[node];
+	}
+
+	return node + 1;
+}
+
+/*
+ * Whether the node is merged into another one by merge_subtrees(), its
+ * subtree is not shown.
+ */
+static bool
+is_merged_node(const node_tree_t *tree, uint32_t node)
+{
+	return tree->tag[node] == TagNode && tree->suffix[node] != node;
+}
+
+/*
+ * The next element of a list hangs from the previous one, unless that is
+ * drawn somewhere else, or also stands for other subtrees; then it hangs
+ * from the row of the list, so no edge suggests a list it is not part of.
+ */
+static bool
+hangs_from_prev(const node_tree_t *tree, uint32_t prev)
+{
+	return prev != InvalidNode && !is_merged_node(tree, prev) &&
+		(tree->shared.empty() || !tree->shared[prev]);
+}
+
+/*
+ * The name without the spaces around it, which depend on the depth of the
+ * node in pretty printed trees.
+ */
+static span_t
+get_trimmed_name(const node_tree_t *tree, uint32_t node)
+{
+	span_t name = get_node_name(tree, node);
+
+	while (name.len > 0 && isspace(*name.ptr)) {
+		name.ptr++;
+		name.len--;
+	}
+	while (name.len > 0 && isspace(name.ptr[name.len - 1])) {
+		name.len--;
+	}
+
+	return name;
+}
+
+/*
+ * Find the end of the name of a node or a field, which starts right after
+ * the '{' or ':' token.
+ *
+ * The name ends at the next '{', '}' or ':' token, which is returned.  A
+ * left parenthesis followed by a left brace starts a list, so it ends the
+ * name too; otherwise parentheses are part of the name.  If the input ends
+ * before we can tell, return NULL, *resume is where to scan again once we
+ * have more input.
+ */
+static const char *
+get_pg_node_name(scanner_t *sc, const char **resume)
 {
-	int ch;
-	size_t node_suffix = 0;
-	node_t *top;
-	bool prev_is_item = false;
-	stack<node_t *> nodes_stack;
+	const char *end = sc->end;
+	const char *p;
 
-	while ((ch = getc(fp)) != EOF) {
-		switch (ch) {
-		case '{':
-			{
-				node_t *node = new node_t();
-
-				node->tag = TagNode;
-				node->name = get_pg_node_name(fp);
-				node->index = 0;
-				node->suffix = node_suffix++;
-
-				top = nodes_stack.empty() ? NULL : nodes_stack.top();
-				if (top != NULL) {
-					size_t src_suffix, src_index;
-					size_t dst_suffix, dst_index;
-					string edgeinfo;
-
-					if (prev_is_item) {
-						node_t *tmp = top;
-
-						assert(!top->elems.empty());
-
-						top = top->elems.back();
-						top->tag = TagHide;
-						top->suffix = tmp->suffix;
-					}
-
-					src_suffix = top->suffix;
-					src_index = top->index;
-					dst_suffix = node->suffix;
-					dst_index = 0;
-
-					/*
-					 * We should update the source information if it's a list
-					 * type and it's elems is not empty.
-					 */
-					if (top->tag == TagList) {
-						if (!top->elems.empty()) {
-							node_t *prev = top->elems.back();
-
-							src_suffix = prev->suffix;
-							src_index = 0;
-						}
-					}
-
-					edgeinfo = get_dot_edge(src_suffix, src_index,
-											dst_suffix, dst_index,
-											top->tag == TagList);
-
-					top->edges.push_back(edgeinfo);
-					top->elems.push_back(node);
-					node->index = top->elems.size();
-				}
+	while ((p = scanner_next(sc)) != NULL) {
+		if (*p == ':' || *p == '{' || *p == '}') {
+			return p;
+		} else if (*p == '(') {
+			/*
+			 * Try to get the next non-space character to determine how
+			 * to deal with a left parenthesis.
+			 * A left parenthesis following a left brace means this is a
+			 * list.
+			 */
+			const char *tmp = p + 1;
+			while (tmp < end && isspace(*tmp)) {
+				tmp++;
+			}
 
-				nodes_stack.push(node);
-				prev_is_item = false;
+			if (tmp == end) {
+				*resume = p;
+				return NULL;
+			}
 
-#ifdef DEBUG
-				write_stderr("STACK: node push %s at stack %u\n",
-							 node->name.c_str(), nodes_stack.size());
-#endif
-				break;
+			if (*tmp == '{') {
+				return p;
 			}
-		case '}':
-			{
-				assert(!nodes_stack.empty());
+		}
+	}
 
-				top = nodes_stack.top();
-				nodes_stack.pop();
-				prev_is_item = false;
+	*resume = end;
+	return NULL;
+}
 
-#ifdef DEBUG
-				write_stderr("STACK: node pop %s from stack %u\n",
-							 top->name.c_str(), nodes_stack.size());
-#endif
-				if (nodes_stack.empty()) {
-					return top;
-				}
+/*
+ * Convert the raw name in the input into the form used in dot script.
+ *
+ * Trim leading and trailing spaces, remove spaces after a left parenthesis
+ * and any illegal characters of dot language.
+ *
+ * Also, convert special characters to HTML entities if html is true.  The
+ * buf must have room for 4 * name.len bytes, return the length of the
+ * converted name.
+ */
+static size_t
+encode_pg_node_name(const span_t& name, char *buf, bool html)
+{
+	const char *p = name.ptr;
+	const char *end = name.ptr + name.len;
+	char *dst = buf;
 
-				break;
+	while (p < end && isspace(*p)) {
+		p++;
+	}
+	while (end > p && isspace(end[-1])) {
+		end--;
+	}
+
+	for (; p < end; p++) {
+		if (*p == '"') {
+			*dst++ = ' ';
+		} else if (*p == '<' && html) {
+			memcpy(dst, "&lt;", 4);
+			dst += 4;
+		} else if (*p == '>' && html) {
+			memcpy(dst, "&gt;", 4);
+			dst += 4;
+		} else {
+			*dst++ = *p;
+		}
+
+		if (*p == '(') {
+			while (p + 1 < end && isspace(p[1])) {
+				p++;
 			}
-		case '(':
-			{
-				node_t *node;
+		}
+	}
 
-				assert(!nodes_stack.empty());
+	return dst - buf;
+}
 
-				top = nodes_stack.top();
+/*
+ * Same as encode_pg_node_name(), but store the result in a string, which
+ * can be reused to avoid allocations.
+ */
+static void
+decode_pg_node_name(const span_t& name, string& buf)
+{
+	buf.resize(name.len * 4);
+	buf.resize(encode_pg_node_name(name, &buf[0], true));
+}
 
-				assert(!top->elems.empty());
+/*
+ * Get the name as it is shown, without HTML entities.
+ */
+static void
+get_display_name(const span_t& name, string& buf)
+{
+	buf.resize(name.len);
+	buf.resize(encode_pg_node_name(name, &buf[0], false));
+}
 
-				node = top->elems.back();
-				node->tag = TagList;
-				node->suffix = top->suffix;
+#define XXH_PRIME64_1	UINT64_C(0x9E3779B185EBCA87)
+#define XXH_PRIME64_2	UINT64_C(0xC2B2AE3D27D4EB4F)
+#define XXH_PRIME64_3	UINT64_C(0x165667B19E3779F9)
+#define XXH_PRIME64_4	UINT64_C(0x85EBCA77C2B2AE63)
+#define XXH_PRIME64_5	UINT64_C(0x27D4EB2F165667C5)
 
-				nodes_stack.push(node);
-				prev_is_item = false;
+#define rotl64(x, r)	(((x) << (r)) | ((x) >> (64 - (r))))
 
-#ifdef DEBUG
-				write_stderr("STACK: list push %s at stack %u\n",
-							 top->name.c_str(), nodes_stack.size());
-#endif
-				break;
-			}
-		case ')':
-			{
-				assert(!nodes_stack.empty());
+static void
+hasher_init(hasher_t *h)
+{
+	h->acc[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+	h->acc[1] = XXH_PRIME64_2;
+	h->acc[2] = 0;
+	h->acc[3] = 0 - XXH_PRIME64_1;
+	h->buflen = 0;
+	h->total = 0;
+}
 
-				top = nodes_stack.top();
-				nodes_stack.pop();
-				prev_is_item = false;
+static void
+hasher_update(hasher_t *h, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	const unsigned char *end = p + len;
 
-#ifdef DEBUG
-				write_stderr("STACK: list pop %s from stack %u\n",
-							 top->name.c_str(), nodes_stack.size());
-#endif
+	h->total += len;
 
-				break;
-			}
-		case ':':
-			{
-				node_t *node = new node_t();
+	/* fill up the stripe left over from the last update */
+	if (h->buflen > 0) {
+		size_t n = min(len, HASHER_STRIPE_SIZE - h->buflen);
 
-				assert(!nodes_stack.empty());
+		memcpy(h->buf + h->buflen, p, n);
+		h->buflen += n;
+		p += n;
+		if (h->buflen < HASHER_STRIPE_SIZE) {
+			return;
+		}
 
-				node->tag = TagItem;
-				node->name = get_pg_node_name(fp);
-				node->suffix = node_suffix++;
+		for (int i = 0; i < 4; i++) {
+			h->acc[i] = hasher_round(h->acc[i], read_uint64(h->buf + i * 8));
+		}
+		h->buflen = 0;
+	}
 
-				/* get top node and push current node in its elems */
-				top = nodes_stack.top();
-				top->elems.push_back(node);
-				node->index = top->elems.size();
-				prev_is_item = true;
+	while (end - p >= HASHER_STRIPE_SIZE) {
+		for (int i = 0; i < 4; i++) {
+			h->acc[i] = hasher_round(h->acc[i], read_uint64(p + i * 8));
+		}
+		p += HASHER_STRIPE_SIZE;
+	}
 
-				break;
-			}
-		default:
-			{
-				/* ignore */
-				break;
-			}
+	memcpy(h->buf, p, end - p);
+	h->buflen = end - p;
+}
+
+static uint64_t
+hasher_final(hasher_t *h)
+{
+	const unsigned char *p = h->buf;
+	const unsigned char *end = h->buf + h->buflen;
+	uint64_t hash;
+
+	if (h->total >= HASHER_STRIPE_SIZE) {
+		hash = rotl64(h->acc[0], 1) + rotl64(h->acc[1], 7) +
+			rotl64(h->acc[2], 12) + rotl64(h->acc[3], 18);
+		for (int i = 0; i < 4; i++) {
+			hash ^= hasher_round(0, h->acc[i]);
+			hash = hash * XXH_PRIME64_1 + XXH_PRIME64_4;
 		}
+	} else {
+		hash = XXH_PRIME64_5;
 	}
 
-	return NULL;
+	hash += h->total;
+
+	for (; end - p >= 8; p += 8) {
+		hash ^= hasher_round(0, read_uint64(p));
+		hash = rotl64(hash, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+	if (end - p >= 4) {
+		hash ^= read_uint32(p) * XXH_PRIME64_1;
+		hash = rotl64(hash, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		hash ^= *p * XXH_PRIME64_5;
+		hash = rotl64(hash, 11) * XXH_PRIME64_1;
+	}
+
+	/* avalanche */
+	hash ^= hash >> 33;
+	hash *= XXH_PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= XXH_PRIME64_3;
+	hash ^= hash >> 32;
+
+	return hash;
 }
 
-static string
-get_pg_node_name(FILE *fp)
+static uint64_t
+hasher_round(uint64_t acc, uint64_t input)
 {
-	int ch;
-	string name;
-	string encode_name;
+	acc += input * XXH_PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * XXH_PRIME64_1;
+}
 
-	while ((ch = getc(fp))) {
-		if (ch == ':' || ch == '{' || ch == '}') {
-			break;
-		} else if (ch == '(') {
-			/*
-			 * Try to get the next non-space character to determine how
-			 * to deal with a left parenthesis.
-			 * A left parenthesis following a left brace means this is a
-			 * list.
-			 */
-			char tmp = getc(fp);
-			while (isspace(tmp)) {
-				tmp = getc(fp);
-			}
+/* little endian, whatever the machine is */
+static uint64_t
+read_uint64(const unsigned char *p)
+{
+	return (uint64_t) read_uint32(p) | ((uint64_t) read_uint32(p + 4) << 32);
+}
 
-			if (tmp == '{') {
-				ungetc(tmp, fp);
-				break;
-			}
+static uint32_t
+read_uint32(const unsigned char *p)
+{
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) |
+		((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void
+writer_init(writer_t *w, int fd)
+{
+	w->fd = fd;
+	w->buf = (char *) malloc(WRITER_BUFFER_SIZE);
+	w->len = 0;
+	w->size = WRITER_BUFFER_SIZE;
+	w->failed = false;
+	w->error = 0;
+
+	if (w->buf == NULL) {
+		write_stderr("%s: out of memory\n", progname);
+		exit(1);
+	}
+}
+
+/*
+ * Write out everything in the buffer.  Once a write fails, the following
+ * output is discarded, and we return false.
+ *
+ * For in-memory writer, this is a no-op.
+ */
+static bool
+writer_flush(writer_t *w)
+{
+	if (w->fd < 0) {
+		return true;
+	}
+
+	if (!w->failed && !write_all(w->fd, w->buf, w->len)) {
+		w->failed = true;
+		w->error = errno;
+	}
+
+	w->len = 0;
+
+	return !w->failed;
+}
 
-			/* part of the name, remove spaces and continue */
-			ungetc(tmp, fp);
+static bool
+write_all(int fd, const char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t nwritten = write(fd, data, len);
+
+		if (nwritten < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
 		}
 
-		name.push_back(ch);
+		data += nwritten;
+		len -= nwritten;
 	}
 
-	/* push back the token */
-	ungetc(ch, fp);
+	return true;
+}
 
-	/*
-	 * Trim leading and trailing spaces and remove any illegal characters
-	 * of dot language.
-	 *
-	 * Also, convert special characters to HTML entities.
-	 */
-	name = trim(name);
-	for (size_t i = 0; i < name.size(); i++) {
-		if (name[i] == '"') {
-			encode_name += ' ';
-		} else if (name[i] == '<') {
-			encode_name += "&lt;";
-		} else if (name[i] == '>') {
-			encode_name += "&gt;";
-		} else {
-			encode_name += name[i];
+static void
+writer_free(writer_t *w)
+{
+	free(w->buf);
+	w->buf = NULL;
+	w->len = 0;
+	w->size = 0;
+}
+
+/*
+ * Make sure there are at least len bytes free in the buffer, and return
+ * where to write them.  The caller advances w->len.
+ */
+static char *
+writer_reserve(writer_t *w, size_t len)
+{
+	if (w->size - w->len < len) {
+		writer_flush(w);
+
+		if (w->size - w->len < len) {
+			size_t size = w->size;
+			char *buf;
+
+			while (size - w->len < len) {
+				size *= 2;
+			}
+
+			buf = (char *) realloc(w->buf, size);
+			if (buf == NULL) {
+				write_stderr("%s: out of memory\n", progname);
+				exit(1);
+			}
+			w->buf = buf;
+			w->size = size;
 		}
 	}
 
-	return encode_name;
+	return w->buf + w->len;
 }
 
-static string
-get_dot_edge(size_t src_suffix, size_t src_index,
-			 size_t dst_suffix, size_t dst_index, bool list)
+static void
+put_bytes(writer_t *w, const char *data, size_t len)
+{
+	memcpy(writer_reserve(w, len), data, len);
+	w->len += len;
+}
+
+static void
+put_string(writer_t *w, const string& str)
+{
+	put_bytes(w, str.data(), str.size());
+}
+
+static void
+put_uint(writer_t *w, uint64_t value)
+{
+	char digits[20];
+	char *p = digits + sizeof(digits);
+
+	do {
+		*--p = '0' + value % 10;
+		value /= 10;
+	} while (value != 0);
+
+	put_bytes(w, p, digits + sizeof(digits) - p);
+}
+
+/*
+ * Encode the name straight into the output buffer.
+ */
+static void
+put_node_name(writer_t *w, const span_t& name)
+{
+	char *buf = writer_reserve(w, name.len * 4);
+
+	w->len += encode_pg_node_name(name, buf, true);
+}
+
+static void
+write_dot_edge(writer_t *w, size_t src_suffix, size_t src_index,
+			   size_t dst_suffix, size_t dst_index, bool list)
 {
-	char color[64] = { 0 };
-	char edge[1024] = { 0 };
+	put_literal(w, "node_");
+	put_uint(w, src_suffix);
+	put_literal(w, ":f");
+	put_uint(w, src_index);
+	put_literal(w, " -> node_");
+	put_uint(w, dst_suffix);
+	put_literal(w, ":f");
+	put_uint(w, dst_index);
 
 	if (enable_color) {
 		if (list) {
-			snprintf(color, sizeof(color), " [color=blue]");
+			put_literal(w, " [color=blue]");
 		} else {
-			snprintf(color, sizeof(color), " [color=green]");
+			put_literal(w, " [color=green]");
 		}
 	}
 
-	snprintf(edge, sizeof(edge),
-			 "node_%lu:f%lu -> node_%lu:f%lu%s;",
-			 src_suffix, src_index, dst_suffix, dst_index, color);
-
-	return string(edge);
+	put_literal(w, ";\n");
 }
 
 static void
-write_dot_script(node_t *root, FILE *fp)
+write_dot_script(const node_tree_t *tree, const graph_pages_t *pages,
+				 uint32_t page, writer_t *w)
 {
-	queue<const node_t *> bfs;
+	uint32_t nnodes = tree->tag.size();
+	string buf;
 
-	fprintf(fp,
-			"digraph PGNodeGraph {\n"
-			"node [shape=none];\n"
-			"rankdir=LR;\n"
-			"size=\"100000,100000\";\n");
+	put_literal(w,
+				"digraph PGNodeGraph {\n"
+				"node [shape=none];\n"
+				"rankdir=LR;\n"
+				"size=\"100000,100000\";\n");
 
-	/* Firstly, construct the nodes. */
-	bfs.push(root);
-	while (!bfs.empty()) {
-		string nodeinfo;
-		const node_t *parent = bfs.front();
+	/*
+	 * Firstly, construct the nodes.  Every node, even one whose fields are
+	 * all filtered out, is output as a separate dot node, the fields are
+	 * its rows.  The children of lists and hidden fields are hooked to the
+	 * parent's row.  The merged subtrees are written once, see
+	 * merge_subtrees().  With pages, only the nodes of the page are written.
+	 */
+	for (uint32_t parent = 0; parent < nnodes; parent++) {
+		if (is_merged_node(tree, parent)) {
+			parent = get_subtree_end(tree, parent) - 1;
+			continue;
+		}
+		if (tree->tag[parent] != TagNode) {
+			continue;
+		}
+		if (pages != NULL && pages->page[parent] != page) {
+			continue;
+		}
 
-		bfs.pop();
-		nodeinfo = get_dot_node_header(parent->suffix, parent->name);
-		for (auto it = parent->elems.begin(); it != parent->elems.end(); it++) {
-			const node_t *child = *it;
-			/*
-			 * If this node has one or more children, we should output it as a
-			 * separate dot node.
-			 */
-			if (!child->elems.empty()) {
-				bfs.push(child);
-			}
+		decode_pg_node_name(get_node_name(tree, parent), buf);
+		write_dot_node_header(w, tree->suffix[parent], buf);
+		for (uint32_t child = tree->first_child[parent];
+			 child != InvalidNode;
+			 child = tree->next_sibling[child]) {
+			span_t name = get_node_name(tree, child);
 
 			/* Do not show empty fields if enable skip empty. */
-			if (!enable_skip_empty || !name_contains_empty(child->name)) {
-				nodeinfo += get_dot_node_body(child->index, child->name);
+			if (!enable_skip_empty || !name_contains_empty(name)) {
+				write_dot_node_body(w, tree->index[child], name, buf);
 			}
 		}
-		nodeinfo += get_dot_node_footer();
+		write_dot_node_footer(w);
+	}
+
+	/*
+	 * Then, wirte the edges between nodes.  Every node except the root has
+	 * an incoming edge, which starts from the row of its parent, or from
+	 * the previous element if its parent is a list.  The edge to a merged
+	 * subtree goes to the one it is merged into.  The edges between pages
+	 * go to stubs.
+	 */
+	for (uint32_t parent = 0; parent < nnodes; parent++) {
+		bool list = tree->tag[parent] == TagList;
+		uint32_t prev = InvalidNode;
 
-		if (parent->tag != TagList && parent->tag != TagHide) {
-			fprintf(fp, "%s\n", nodeinfo.c_str());
+		if (is_merged_node(tree, parent)) {
+			parent = get_subtree_end(tree, parent) - 1;
+			continue;
 		}
-	}
 
-	/* Then, wirte the edges between nodes. */
-	bfs.push(root);
-	while (!bfs.empty()) {
-		const node_t *curr = bfs.front();
+		for (uint32_t child = tree->first_child[parent];
+			 child != InvalidNode;
+			 prev = child, child = tree->next_sibling[child]) {
+			size_t src_suffix;
+			size_t src_index;
+			size_t dst_suffix = tree->suffix[child];
+
+			if (tree->tag[child] != TagNode) {
+				continue;
+			}
+
+			if (list && hangs_from_prev(tree, prev)) {
+				src_suffix = tree->suffix[prev];
+				src_index = 0;
+			} else {
+				src_suffix = tree->suffix[parent];
+				src_index = tree->index[parent];
+			}
 
-		bfs.pop();
-		for (auto it = curr->elems.begin(); it != curr->elems.end(); it++) {
-			bfs.push(*it);
+			if (pages == NULL || (pages->page[src_suffix] == page &&
+								  pages->page[dst_suffix] == page)) {
+				write_dot_edge(w, src_suffix, src_index, dst_suffix, 0, list);
+			} else if (pages->page[src_suffix] == page) {
+				write_page_stub(w, tree, pages, src_suffix, src_index,
+								dst_suffix, list, true);
+			} else if (pages->page[dst_suffix] == page) {
+				write_page_stub(w, tree, pages, src_suffix, src_index,
+								dst_suffix, list, false);
+			}
 		}
+	}
 
-		for(auto it = curr->edges.begin(); it != curr->edges.end(); it++) {
-			fprintf(fp, "%s\n", it->c_str());
+	put_literal(w, "}\n");
+}
+
+/*
+ * Write an edge between two pages, as an edge to or from a stub of the
+ * other page, which links to its picture.
+ */
+static void
+write_page_stub(writer_t *w, const node_tree_t *tree,
+				const graph_pages_t *pages, size_t src_suffix,
+				size_t src_index, size_t dst_suffix, bool list, bool out)
+{
+	size_t other = out ? dst_suffix : src_suffix;
+	uint32_t page = pages->page[other];
+	const string& imgfile = pages->imgfiles[page];
+	size_t start = imgfile.find_last_of('/') + 1;
+
+	if (out) {
+		put_literal(w, "page_out_");
+	} else {
+		put_literal(w, "page_in_");
+	}
+	put_uint(w, other);
+	put_literal(w, " [shape=box, style=dashed, label=\"page ");
+	put_uint(w, page + 1);
+	if (out) {
+		span_t name = get_node_name(tree, dst_suffix);
+		span_t type = get_node_type(name.ptr, name.ptr + name.len);
+
+		put_literal(w, "\\n");
+		put_bytes(w, type.ptr, type.len);
+	}
+	put_literal(w, "\", URL=\"");
+	for (size_t i = start; i < imgfile.size(); i++) {
+		if (imgfile[i] == '"' || imgfile[i] == '\\') {
+			put_literal(w, "\\");
 		}
+		put_bytes(w, &imgfile[i], 1);
+	}
+	put_literal(w, "\"];\n");
+
+	if (out) {
+		put_literal(w, "node_");
+		put_uint(w, src_suffix);
+		put_literal(w, ":f");
+		put_uint(w, src_index);
+		put_literal(w, " -> page_out_");
+		put_uint(w, dst_suffix);
+	} else {
+		put_literal(w, "page_in_");
+		put_uint(w, src_suffix);
+		put_literal(w, " -> node_");
+		put_uint(w, dst_suffix);
+		put_literal(w, ":f0");
+	}
 
-		/* Now, we can release the memory. */
-		delete curr;
+	if (enable_color) {
+		if (list) {
+			put_literal(w, " [color=blue]");
+		} else {
+			put_literal(w, " [color=green]");
+		}
 	}
 
-	fprintf(fp, "}\n");
-	fflush(fp);
+	put_literal(w, ";\n");
 }
 
-static string
-get_dot_node_header(size_t suffix, const string& name)
+static void
+write_dot_node_header(writer_t *w, size_t suffix, const string& name)
 {
-	char brcolor[64] = { 0 };
-	char bgcolor[64] = { 0 };
-	char ftcolor[64] = { 0 };
-	char node_header[4096] = { 0 };
+	const node_color_t *colors = NULL;
 
 	if (enable_color) {
 		auto it = node_color_mapping.find(name);
 		if (it != node_color_mapping.end()) {
-
-			if (!it->second.bgcolor.empty()) {
-				snprintf(bgcolor, sizeof(bgcolor), " bgcolor=\"%s\"",
-						 it->second.bgcolor.c_str());
-				snprintf(brcolor, sizeof(brcolor), " color=\"%s\"",
-						 it->second.bgcolor.c_str());
-			}
-
-			if (!it->second.fontcolor.empty()) {
-				snprintf(ftcolor, sizeof(ftcolor), " color=\"%s\"",
-						 it->second.fontcolor.c_str());
-			}
+			colors = &it->second;
 		}
 	}
 
+	put_literal(w, "node_");
+	put_uint(w, suffix);
+	put_literal(w,
+				" [\n"
+				"  label=<<table border=\"0\" cellspacing=\"0\"");
+
 	/* The border color is same as background color. */
-	snprintf(node_header, sizeof(node_header),
-			 "node_%lu [\n"
-			 "  label=<<table border=\"0\" cellspacing=\"0\"%s>\n"
-			 "    <tr>\n"
-			 "      <td port=\"f0\" border=\"1\"%s>\n"
-			 "       <B><font%s>%s</font></B>\n"
-			 "      </td>\n"
-			 "    </tr>\n",
-			 suffix, brcolor, bgcolor, ftcolor, name.c_str());
+	if (colors != NULL && !colors->bgcolor.empty()) {
+		put_literal(w, " color=\"");
+		put_string(w, colors->bgcolor);
+		put_literal(w, "\"");
+	}
+
+	put_literal(w,
+				">\n"
+				"    <tr>\n"
+				"      <td port=\"f0\" border=\"1\"");
+
+	if (colors != NULL && !colors->bgcolor.empty()) {
+		put_literal(w, " bgcolor=\"");
+		put_string(w, colors->bgcolor);
+		put_literal(w, "\"");
+	}
 
-	return string(node_header);
+	put_literal(w,
+				">\n"
+				"       <B><font");
+
+	if (colors != NULL && !colors->fontcolor.empty()) {
+		put_literal(w, " color=\"");
+		put_string(w, colors->fontcolor);
+		put_literal(w, "\"");
+	}
+
+	put_literal(w, ">");
+	put_string(w, name);
+	put_literal(w,
+				"</font></B>\n"
+				"      </td>\n"
+				"    </tr>\n");
 }
 
-static string
-get_dot_node_body(size_t suffix, const string& name)
+/*
+ * Write a row for the field, the buf is a scratch space for the fields
+ * which need reformatting.
+ */
+static void
+write_dot_node_body(writer_t *w, size_t suffix, const span_t& name,
+					string& buf)
 {
-	char node_body[4096] = { 0 };
-	string node_name;
+	put_literal(w, "    <tr><td port=\"f");
+	put_uint(w, suffix);
+	put_literal(w, "\" border=\"1\">");
 
-	if (name.find("colnames") != string::npos) {
-		node_name = format_colnames(name);
+	if (memmem(name.ptr, name.len, "colnames", 8) != NULL) {
+		decode_pg_node_name(name, buf);
+		write_colnames(w, buf);
 	} else {
-		node_name = name;
+		put_node_name(w, name);
 	}
 
-	snprintf(node_body, sizeof(node_body),
-			 "    <tr><td port=\"f%lu\" border=\"1\">%s</td></tr>\n",
-			 suffix, node_name.c_str());
-
-	return string(node_body);
+	put_literal(w, "</td></tr>\n");
 }
 
-static string
-get_dot_node_footer(void)
+static void
+write_dot_node_footer(writer_t *w)
 {
-	return string("  </table>>\n];");
+	put_literal(w, "  </table>>\n];\n");
 }
 
 /*
@@ -843,13 +7140,13 @@ get_dot_node_footer(void)
  * here is a NULL pointer represented by "--".
  */
 static bool
-name_contains_empty(const string& name)
+name_contains_empty(const span_t& name)
 {
 	/*
 	 * NB: You could define more empty value, if you defined, change the
 	 * following code to contains your new empty value checking.
 	 */
-	return name.find("--") != string::npos;
+	return memmem(name.ptr, name.len, "--", 2) != NULL;
 }
 
 static string
@@ -871,6 +7168,10 @@ get_img_filename(const string& pathname)
 {
 	string img_suffix(string(".") + picture_format);
 
+	if (stdout_mode == StdoutPicture) {
+		return "-";
+	}
+
 	if (img_directory) {
 		size_t found = pathname.find_last_of("/");
 		string name = pathname.substr(found + 1);
@@ -880,50 +7181,74 @@ get_img_filename(const string& pathname)
 	return pathname + img_suffix;
 }
 
-static string
-format_colnames(const string& name)
+static void
+write_colnames(writer_t *w, const string& name)
 {
-	string tmp;
-	string new_name;
+	const char *p;
+	const char *end = name.data() + name.size();
+	size_t pos;
 
 	if (name == "colnames --") {
-		return name;
+		put_string(w, name);
+		return;
 	}
 
-	new_name = "    \n<table border=\"0\" cellspacing=\"0\"> \n";
-	size_t pos = name.find("(");
-	new_name += "      <tr>\n";
-	new_name += "        <td>" + name.substr(0, pos + 1) + "</td>\n";
-	new_name += "        <td></td>\n";
-	new_name += "      </tr>\n";
-
-	tmp = name.substr(pos + 1);
-	tmp = ltrim(tmp);
-	while (tmp.find(' ') != string::npos) {
-		pos = tmp.find(' ');
-		string t = tmp.substr(0, pos);
-		t = rtrim(t);
+	put_literal(w, "    \n<table border=\"0\" cellspacing=\"0\"> \n");
+
+	pos = name.find("(");
+	pos = (pos == string::npos) ? 0 : pos + 1;
+	put_literal(w,
+				"      <tr>\n"
+				"        <td>");
+	put_bytes(w, name.data(), pos);
+	put_literal(w,
+				"</td>\n"
+				"        <td></td>\n"
+				"      </tr>\n");
+
+	p = name.data() + pos;
+	while (p < end && isspace(*p)) {
+		p++;
+	}
 
-		new_name += "      <tr>\n";
-		new_name += "        <td></td>\n";
-		new_name += "        <td align=\"left\">" + t + "</td>\n";
-		new_name += "      </tr>\n";
+	for (;;) {
+		const char *space = (const char *) memchr(p, ' ', end - p);
+		const char *t;
 
-		if (pos == string::npos) {
+		if (space == NULL) {
 			break;
 		}
 
-		tmp = ltrim(tmp.substr(pos + 1));
-	}
+		t = space;
+		while (t > p && isspace(t[-1])) {
+			t--;
+		}
 
-	if (!tmp.empty()) {
-		new_name += "      <tr>\n";
-		new_name += "        <td>" + tmp + "</td>\n";
-		new_name += "        <td></td>\n";
-		new_name += "      </tr>\n";
+		put_literal(w,
+					"      <tr>\n"
+					"        <td></td>\n"
+					"        <td align=\"left\">");
+		put_bytes(w, p, t - p);
+		put_literal(w,
+					"</td>\n"
+					"      </tr>\n");
+
+		p = space + 1;
+		while (p < end && isspace(*p)) {
+			p++;
+		}
 	}
 
-	new_name += "    </table>\n";
+	if (p < end) {
+		put_literal(w,
+					"      <tr>\n"
+					"        <td>");
+		put_bytes(w, p, end - p);
+		put_literal(w,
+					"</td>\n"
+					"        <td></td>\n"
+					"      </tr>\n");
+	}
 
-	return new_name;
+	put_literal(w, "    </table>\n");
 }